@@ -33,9 +33,13 @@
 #include <fuse.h>
 #include <libgen.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/types.h>
 
@@ -72,6 +76,238 @@ static void gsfs_fullpath(char fpath[PATH_MAX], const char *path)
 	    gsfs_DATA->rootdir, path, fpath);
 }
 
+// Runtime control. Every file in here but two is a knob: reading it gives
+// its current value, and writing a number to it (followed by a newline,
+// or not) sets it, taking effect straight away. Writing artist names to
+// "register", one per line, registers them all in the background, and
+// reading it reports progress; writing anything to "drop_caches" evicts
+// every chunk of audio that isn't being read from. The profiling build
+// adds "profile", which dumps the profile (see gsfs_profile.c).
+#define GSFS_CONTROL_DIR "/.gsfs"
+
+typedef enum {
+	CONTROL_NONE,
+	CONTROL_REGISTER,
+	CONTROL_DROP_CACHES,
+	CONTROL_PROFILE,
+	CONTROL_KNOB
+} GSFS_Control;
+
+typedef enum {
+	KNOB_INT,         // an atomic_int
+	KNOB_SIZE,        // an atomic_size_t
+	KNOB_CACHE_SIZE,  // the audio cache's budget, which has to evict
+	KNOB_DISK_CACHE_SIZE // the disk cache's, likewise
+} GSFS_Knob_Type;
+
+typedef struct {
+	const char *name;
+	GSFS_Knob_Type type;
+	void  *value;
+	size_t min;
+	size_t max;
+} GSFS_Knob;
+
+static GSFS_Knob gsfs_knobs[] = {
+	{ "cache_size",           KNOB_CACHE_SIZE, NULL, GSFS_CHUNK_SIZE, SIZE_MAX },
+	{ "disk_cache_size",      KNOB_DISK_CACHE_SIZE, NULL, GSFS_CHUNK_SIZE, SIZE_MAX },
+	{ "readahead_chunks",     KNOB_INT,  &gsfs_readahead_chunks,   0, 1024 },
+	{ "prefetch_threshold",   KNOB_SIZE, &gsfs_prefetch_threshold, 0, SIZE_MAX },
+	{ "prefetch_tracks",      KNOB_INT,  &gsfs_prefetch_tracks,    0, 64 },
+	{ "prefetch_chunks",      KNOB_INT,  &gsfs_prefetch_chunks,    0, 1024 },
+	{ "prefetch_rate",        KNOB_SIZE, &gsfs_prefetch_rate,      0, SIZE_MAX },
+	{ "prefetch_budget",      KNOB_SIZE, &gsfs_prefetch_budget,    GSFS_CHUNK_SIZE, SIZE_MAX },
+	{ "bandwidth_limit",      KNOB_SIZE, &gsfs_bandwidth_limit,    0, SIZE_MAX },
+	{ "stream_rate_limit",    KNOB_SIZE, &gsfs_stream_rate_limit,  0, SIZE_MAX },
+	// how many of the scheduler's workers each priority may use at once
+	{ "read_workers",         KNOB_INT, &gsfs_sched_cap[GSFS_PRIO_READ],         1, GSFS_SCHED_THREADS },
+	{ "readahead_workers",    KNOB_INT, &gsfs_sched_cap[GSFS_PRIO_READAHEAD],    1, GSFS_SCHED_THREADS },
+	{ "transcode_workers",    KNOB_INT, &gsfs_sched_cap[GSFS_PRIO_TRANSCODE],    1, GSFS_SCHED_THREADS },
+	{ "prefetch_workers",     KNOB_INT, &gsfs_sched_cap[GSFS_PRIO_PREFETCH],     1, GSFS_SCHED_THREADS },
+	{ "registration_workers", KNOB_INT, &gsfs_sched_cap[GSFS_PRIO_REGISTRATION], 1, GSFS_SCHED_THREADS },
+};
+
+#define GSFS_NUM_KNOBS (sizeof(gsfs_knobs) / sizeof(GSFS_Knob))
+
+// Which control file path is, if any, and its knob if it's one
+static GSFS_Control gsfs_control_file(const char *path, GSFS_Knob **knob)
+{
+	size_t len = strlen(GSFS_CONTROL_DIR);
+	if(strncmp(path, GSFS_CONTROL_DIR, len) != 0 || path[len] != '/')
+		return CONTROL_NONE;
+	const char *name = path + len + 1;
+	
+	if(strcmp(name, "register") == 0)
+		return CONTROL_REGISTER;
+	if(strcmp(name, "drop_caches") == 0)
+		return CONTROL_DROP_CACHES;
+#ifdef GSFS_PROFILE
+	if(strcmp(name, "profile") == 0)
+		return CONTROL_PROFILE;
+#endif
+	for(int i = 0; i < GSFS_NUM_KNOBS; i++)
+	{
+		if(strcmp(name, gsfs_knobs[i].name) == 0)
+		{
+			*knob = &gsfs_knobs[i];
+			return CONTROL_KNOB;
+		}
+	}
+	return CONTROL_NONE;
+}
+
+static size_t gsfs_knob_get(GSFS_Knob *knob)
+{
+	size_t budget, used;
+	long songs;
+	
+	switch(knob->type)
+	{
+	case KNOB_INT:
+		return atomic_load((atomic_int *) knob->value);
+	case KNOB_SIZE:
+		return atomic_load((atomic_size_t *) knob->value);
+	case KNOB_CACHE_SIZE:
+		gsfs_audio_usage(&budget, &used, &songs);
+		return budget;
+	case KNOB_DISK_CACHE_SIZE:
+		gsfs_disk_cache_usage(&budget, &used);
+		return budget;
+	}
+	return 0;
+}
+
+// Set a knob from what was written to it; EINVAL unless it's a whole
+// number the knob can take
+static int gsfs_knob_set(GSFS_Knob *knob, const char *text)
+{
+	while(isspace((unsigned char) *text))
+		text++;
+	if(!isdigit((unsigned char) *text))
+		return EINVAL;
+	
+	char *end;
+	errno = 0;
+	unsigned long long value = strtoull(text, &end, 10);
+	while(isspace((unsigned char) *end))
+		end++;
+	if(errno != 0 || *end != '\0' || value < knob->min || value > knob->max)
+		return EINVAL;
+	
+	switch(knob->type)
+	{
+	case KNOB_INT:
+		atomic_store((atomic_int *) knob->value, (int) value);
+		break;
+	case KNOB_SIZE:
+		atomic_store((atomic_size_t *) knob->value, (size_t) value);
+		break;
+	case KNOB_CACHE_SIZE:
+		gsfs_audio_set_budget(value);
+		break;
+	case KNOB_DISK_CACHE_SIZE:
+		gsfs_disk_cache_set_budget(value);
+		break;
+	}
+	log_msg("    %s set to %llu\n", knob->name, value);
+	return SUCCESS;
+}
+
+// Every open song gets one of these, stored in fi->fh, so that reads
+// don't have to re-parse and re-query the path and so we can tell when
+// a song is being played straight through.
+typedef struct {
+	Song  *song;
+	GSFS_Variant *variant; // set when a transcoded variant was opened
+	off_t  next_offset;   // where the next sequential read would start
+	size_t sequential;    // bytes read sequentially so far
+	int    prefetched;    // have we prefetched the following songs yet?
+	int    readahead_until; // last chunk readahead has been started for
+	int    logged_until;    // last chunk recorded in the access log
+	GSFS_Job_Group *group;  // background jobs working for this stream
+	GSFS_Stream *stream;    // readahead goes through the bandwidth shaper
+	struct timespec opened;
+	int    first_read_done;
+	
+	// the ID3 tag served ahead of the song's own bytes
+	unsigned char *tag;
+	size_t tag_len;
+	
+	// a control file was opened instead of a song
+	GSFS_Control control;
+	GSFS_Knob *knob;
+	char   line[MAX_PATH];  // a partially written line
+	int    line_len;
+} GSFS_File_Handle;
+
+// Act on every complete line written to a control file: register the
+// artist, or set the knob. A trailing partial line waits for the rest of
+// it, or for the file to be flushed. Returns EINVAL if a knob was given
+// a value it can't take.
+static int gsfs_control_lines(GSFS_File_Handle *handle, const char *buf, size_t size)
+{
+	int error = SUCCESS;
+	
+	for(size_t i = 0; i < size; i++)
+	{
+		if(buf[i] == '\n')
+		{
+			handle->line[handle->line_len] = '\0';
+			if(handle->line_len > 0)
+			{
+				if(handle->control == CONTROL_REGISTER)
+					gsfs_bulk_register(handle->line);
+				else if(gsfs_knob_set(handle->knob, handle->line) != SUCCESS)
+					error = EINVAL;
+			}
+			handle->line_len = 0;
+		}
+		else if(handle->line_len < MAX_PATH - 1)
+			handle->line[handle->line_len++] = buf[i];
+	}
+	return error;
+}
+
+static double gsfs_elapsed_ms(struct timespec *since)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - since->tv_sec) * 1000.0
+		+ (now.tv_nsec - since->tv_nsec) / 1000000.0;
+}
+
+// A read waits on one of these while the chunks it covers are fetched
+// in parallel; each completed fetch counts pending down by one.
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t  cond;
+	int pending;
+	int error;
+} GSFS_Read_Wait;
+
+static void gsfs_read_chunk_done(void *arg, int error)
+{
+	GSFS_Read_Wait *wait = arg;
+	
+	pthread_mutex_lock(&wait->lock);
+	if(error != SUCCESS)
+		wait->error = error;
+	if(--wait->pending == 0)
+		pthread_cond_signal(&wait->cond);
+	pthread_mutex_unlock(&wait->lock);
+}
+
+// Every open directory gets one of these, stored in fi->fh. It pins the
+// catalog version (and the artist) it was opened against, so a listing
+// stays consistent however long it takes, even if the artist is removed
+// meanwhile.
+typedef struct {
+	GSFS_Catalog *catalog;
+	Artist *artist;   // set for artist and album directories
+	Album  *album;    // set for album directories
+	int    control;   // set for the control directory, which needs neither
+} GSFS_Dir_Handle;
+
 ///////////////////////////////////////////////////////////
 //
 // Prototypes for all these functions, and the C-style comments,
@@ -86,6 +322,7 @@ static void gsfs_fullpath(char fpath[PATH_MAX], const char *path)
  // http://man7.org/linux/man-pages/man2/stat.2.html
 int gsfs_getattr(const char *path, struct stat *statbuf)
 {
+	GSFS_PROFILE_SCOPE(__func__);
 	log_msg("\ngsfs_getattr(path=\"%s\", statbuf=0x%08x)\n",
 		path, statbuf);
 	
@@ -104,6 +341,28 @@ int gsfs_getattr(const char *path, struct stat *statbuf)
 		| S_IRUSR  // owner has read permission
 		| S_IRGRP; // group has read permission
 	
+	GSFS_Knob *knob;
+	switch(gsfs_control_file(path, &knob))
+	{
+	case CONTROL_NONE:
+		break;
+	case CONTROL_DROP_CACHES:
+	case CONTROL_PROFILE:
+		// there's nothing to read back
+		statbuf->st_mode = S_IFREG | S_IWUSR;
+		statbuf->st_nlink = 1;
+		return SUCCESS;
+	default:
+		statbuf->st_mode |= S_IFREG | S_IWUSR;
+		statbuf->st_nlink = 1;
+		return SUCCESS;
+	}
+	if(strcmp(path, GSFS_CONTROL_DIR) == 0)
+	{
+		statbuf->st_mode |= S_IFDIR;
+		return SUCCESS;
+	}
+	
 	GSFS_Path_Components 
 		path_components = gsfs_parse_path(path);	
 	
@@ -120,14 +379,20 @@ int gsfs_getattr(const char *path, struct stat *statbuf)
 	
 	if(path_components.level != ROOT)
 	{
+		gsfs_catalog_enter();
 		GSFS_Query_FS_Results
 			results = gsfs_query_fs(path_components);
+		
+		// a song is as long as its audio plus the tag we put in front
+		if(results.error == 0 && path_components.level == SONG
+			&& path_components.bitrate == 0)
+			statbuf->st_size = gsfs_song_id3_length(results.song) + gsfs_song_size(results.song);
+		gsfs_catalog_exit();
 			
 		if(results.error != 0)
 			return ENOENT;
 	}
-	else
-		return SUCCESS;
+	return SUCCESS;
 }
 
 /** Read the target of a symbolic link
@@ -185,8 +450,13 @@ int gsfs_mknod(const char *path, mode_t mode, dev_t dev)
 // http://linux.die.net/man/2/mkdir
 int gsfs_mkdir(const char *path, mode_t mode)
 {
+	GSFS_PROFILE_SCOPE(__func__);
 	log_msg("\ngsfs_mkdir(path=\"%s\", mode=0%3o)\n",
 	    path, mode);
+	
+	// not an artist, however much it looks like one
+	if(strcmp(path, GSFS_CONTROL_DIR) == 0)
+		return EEXIST;
 		
 	GSFS_Path_Components 
 		path_components = gsfs_parse_path(path);
@@ -195,21 +465,19 @@ int gsfs_mkdir(const char *path, mode_t mode)
 		// artist and album folders are read-only
 		return EROFS;
 	
-	GSFS_Query_FS_Result 
-		result = gsfs_query_fs(path_components.artist_name);
-		
-	if(result.error == SUCCESS)
-		// do not allow duplicate artists to be created
-		return EEXIST;
-		
 	// attempt to register the artist
-	switch(gsfs_register_artist(path_components))
+	switch(gsfs_register_artist_by_name(path_components.artist_name, 1))
 	{
 	case SUCCESS:
 		return SUCCESS;
+	case EEXIST:
+		// do not allow duplicate artists to be created
+		return EEXIST;
+	case ENOMEM:
+		return ENOMEM;
 	case ERROR_ARTIST_NOT_FOUND:
-		return EOPNOTSUPP;
 	case ERROR_CONNECTION_LOST:
+	default:
 		return EOPNOTSUPP;
 	}
 }
@@ -233,8 +501,12 @@ int gsfs_unlink(const char *path)
 */
 int gsfs_rmdir(const char *path)
 {
+	GSFS_PROFILE_SCOPE(__func__);
 	log_msg("gsfs_rmdir(path=\"%s\")\n",
 	    path);
+	
+	if(strcmp(path, GSFS_CONTROL_DIR) == 0)
+		return EPERM;
 		
 	GSFS_Path_Components 
 		path_components = gsfs_parse_path(path);
@@ -245,10 +517,15 @@ int gsfs_rmdir(const char *path)
 		return EOPNOTSUPP;
 	// Artists may be deleted conditionally
 	case ARTIST:
+		// anyone still listing or playing the artist keeps it until
+		// they're done
 		switch(gsfs_deregister_artist(path_components.artist_name)){
 		case SUCCESS:
 			return 0;
+		case ENOMEM:
+			return ENOMEM;
 		case ERROR_ARTIST_NOT_FOUND:
+		default:
 			return EOPNOTSUPP;
 		}
 	case ALBUM:
@@ -318,8 +595,13 @@ int gsfs_chown(const char *path, uid_t uid, gid_t gid)
 */
 int gsfs_truncate(const char *path, off_t newsize)
 {
+	GSFS_PROFILE_SCOPE(__func__);
     log_msg("\ngsfs_truncate(path=\"%s\", newsize=%lld)\n",
 	    path, newsize);
+	// shells truncate control files before writing to them
+	GSFS_Knob *knob;
+	if(gsfs_control_file(path, &knob) != CONTROL_NONE)
+		return SUCCESS;
     return EOPNOTSUPP;
 }
 
@@ -353,9 +635,93 @@ int gsfs_utime(const char *path, struct utimbuf *ubuf)
  */
 int gsfs_open(const char *path, struct fuse_file_info *fi)
 {
+	GSFS_PROFILE_SCOPE(__func__);
     log_msg("\ngsfs_open(path\"%s\", fi=0x%08x)\n",
 	    path, fi);
-	return 0;
+	
+	GSFS_Knob *knob = NULL;
+	GSFS_Control control = gsfs_control_file(path, &knob);
+	if(control != CONTROL_NONE)
+	{
+		GSFS_File_Handle *handle = calloc(1, sizeof(GSFS_File_Handle));
+		if(handle == NULL)
+			return ENOMEM;
+		handle->control = control;
+		handle->knob = knob;
+		fi->fh = (uint64_t) handle;
+		return SUCCESS;
+	}
+	if(strcmp(path, GSFS_CONTROL_DIR) == 0)
+		return EISDIR;
+	
+	GSFS_Path_Components 
+		path_components = gsfs_parse_path(path);
+	
+	// if not a file, abort with error
+	if(path_components.level != SONG)
+		return EISDIR;
+	
+	// songs are read-only
+	if((fi->flags & O_ACCMODE) != O_RDONLY)
+		return EROFS;
+	
+	GSFS_File_Handle *handle = calloc(1, sizeof(GSFS_File_Handle));
+	if(handle == NULL)
+		return ENOMEM;
+	
+	// hold on to the song's artist for as long as the file is open, so
+	// it can't be deregistered out from under us
+	gsfs_catalog_enter();
+	GSFS_Query_FS_Result
+		result = gsfs_query_fs(path_components);
+	if(result.error == SUCCESS)
+		gsfs_artist_ref(result.song->album->artist);
+	gsfs_catalog_exit();
+	
+	if(result.error != SUCCESS)
+	{
+		free(handle);
+		// error: no such file or directory
+		return ENOENT;
+	}
+	
+	handle->song = result.song;
+	handle->readahead_until = -1;
+	handle->logged_until = -1;
+	handle->group = gsfs_job_group_new();
+	if(handle->group != NULL)
+		handle->stream = gsfs_stream_new(handle->group);
+	if(handle->stream == NULL)
+	{
+		gsfs_job_group_cancel(handle->group);
+		gsfs_artist_unref(result.song->album->artist);
+		free(handle);
+		return ENOMEM;
+	}
+	
+	// a variant's length isn't known until it's encoded, so getattr
+	// can't give one; direct_io makes the kernel read until we stop
+	// returning bytes rather than up to st_size
+	if(path_components.bitrate != 0)
+	{
+		handle->variant = gsfs_get_variant(result.song, path_components.bitrate);
+		fi->direct_io = 1;
+	}
+	else
+		handle->tag = gsfs_song_id3_tag(result.song, &handle->tag_len);
+	
+	if(handle->variant == NULL && handle->tag == NULL)
+	{
+		gsfs_stream_free(handle->stream, path);
+		gsfs_job_group_cancel(handle->group);
+		gsfs_artist_unref(result.song->album->artist);
+		free(handle);
+		return ENOMEM;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &handle->opened);
+	fi->fh = (uint64_t) handle;
+	
+	return SUCCESS;
 }
 
 /** Read data from an open file
@@ -375,53 +741,205 @@ int gsfs_open(const char *path, struct fuse_file_info *fi)
 // with the fusexmp code which returns the amount of data also
 // returned by read.
 
-/* Download or read binary song data from cache 
-	TODO: what happens when an invalid path is given?
+/* Read binary song data from the audio cache, downloading the chunks
+   the read covers if they aren't cached yet.
 */
 int gsfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 {
+	GSFS_PROFILE_SCOPE(__func__);
     log_msg("\ngsfs_read(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)\n",
 	    path, buf, size, offset, fi);
-		
-	GSFS_Path_Components 
-		path_components = gsfs_parse_path(path);
 	
-	// if not a file, abort with error
-	if(path_components.level != SONG)
-		return EISDIR;
-		
-	// Songs are files, may be read
-	// query for a song object using path components
-	GSFS_Query_FS_Result
-		result = gsfs_query_fs(path_components);
+	GSFS_File_Handle *handle = (GSFS_File_Handle *) fi->fh;
+	Song *song = handle->song;
 	
-	if(result.error != SUCCESS)
-		// error: no such file or directory
-		return ENOENT;
+	// the register file reads back bulk registration progress, and
+	// knobs their values
+	if(handle->control != CONTROL_NONE)
+	{
+		char status[128];
+		int len = 0;
+		if(handle->control == CONTROL_REGISTER)
+			len = snprintf(status, sizeof(status), "queued %d registered %d failed %d\n",
+				atomic_load(&gsfs_bulk_queued),
+				atomic_load(&gsfs_bulk_registered),
+				atomic_load(&gsfs_bulk_failed));
+		else if(handle->control == CONTROL_KNOB)
+			len = snprintf(status, sizeof(status), "%zu\n", gsfs_knob_get(handle->knob));
+		if(offset >= len)
+			return 0;
+		if(offset + size > len)
+			size = len - offset;
+		memcpy(buf, status + offset, size);
+		return size;
+	}
 	
-	GSFS_Audio_Data *audio_data;
-	switch(gsfs_get_song_audio(query_result.song))
+	// transcoded variants come out of the encoder, not the audio cache
+	if(handle->variant != NULL)
 	{
-	case ENOMEM:
-		// out of memory
-		return EOPNOTSUPP;
-	case ERROR_CONNECTION_LOST:
-		// connection lost
-		return EOPNOTSUPP;
-	case SUCCESS:
-		// copy audio-data to buffer
-		if(offset > audio->len)
+		int len = gsfs_read_variant(handle->variant, buf, size, offset);
+		if(len < 0)
+			return EOPNOTSUPP;
+		return len;
+	}
+	
+	// the tag comes first, straight from memory; past it, offsets are
+	// translated back into the song's own audio
+	size_t tag_copied = 0;
+	if(offset < handle->tag_len)
+	{
+		tag_copied = handle->tag_len - offset;
+		if(tag_copied > size)
+			tag_copied = size;
+		memcpy(buf, handle->tag + offset, tag_copied);
+		buf += tag_copied;
+		size -= tag_copied;
+		offset = handle->tag_len;
+	}
+	offset -= handle->tag_len;
+	
+	// reads past the end of the song return nothing
+	size_t song_size = gsfs_song_size(song);
+	if(offset >= song_size)
+		return tag_copied;
+	if(offset + size > song_size)
+		size = song_size - offset;
+	
+	if(size == 0)
+		return tag_copied;
+	
+	// start fetching every chunk the read covers at once, then wait for
+	// all of them together rather than one after the other
+	int first = offset / GSFS_CHUNK_SIZE;
+	int last = (offset + size - 1) / GSFS_CHUNK_SIZE;
+	
+	GSFS_Read_Wait wait = {
+		PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+		last - first + 1, SUCCESS
+	};
+	int stalled = 0;
+	for(int index = first; index <= last; index++)
+	{
+		if(!gsfs_song_chunk_ready(song, index))
+			stalled = 1;
+		gsfs_get_song_audio_async(song, index, GSFS_PRIO_READ, NULL,
+			gsfs_read_chunk_done, &wait);
+	}
+	
+	// a stream playing straight through ran out of buffered audio
+	if(stalled && handle->first_read_done && offset == handle->next_offset)
+		gsfs_stream_stall(handle->stream);
+	
+	pthread_mutex_lock(&wait.lock);
+	while(wait.pending > 0)
+		pthread_cond_wait(&wait.cond, &wait.lock);
+	pthread_mutex_unlock(&wait.lock);
+	
+	// a chunk that failed is fetched again below, so the read can
+	// still get as far as the audio goes
+	if(wait.error != SUCCESS)
+		log_msg("    fetching \"%s\" chunks %d to %d failed: %d\n",
+			path, first, last, wait.error);
+	
+	// copy the audio out chunk by chunk
+	size_t copied = 0;
+	while(copied < size)
+	{
+		int    index = (offset + copied) / GSFS_CHUNK_SIZE;
+		size_t chunk_offset = (offset + copied) % GSFS_CHUNK_SIZE;
+		
+		// usually still in memory, so this doesn't wait
+		GSFS_Audio_Chunk *chunk;
+		int error = gsfs_get_song_audio(song, index, GSFS_PRIO_READ, &chunk);
+		if(error != SUCCESS)
 		{
-			if(offset+size > audio->len)
-				size = audio->len - offset;			
-			memcpy(buf, audio->data + offset, size);
+			// hand back what we have; the reader asks again for the rest
+			if(tag_copied + copied > 0)
+				break;
+			// admission let the read through, but the allocator still
+			// couldn't find the memory
+			if(error == ENOMEM)
+				return ENOMEM;
+			// connection lost
+			return EOPNOTSUPP;
 		}
-		else
+		
+		// grooveshark gave us less audio than the catalog promised
+		if(chunk_offset >= chunk->len)
 		{
-			size = 0;
+			gsfs_put_song_audio(chunk);
+			break;
 		}
-		return size;
+		
+		size_t len = chunk->len - chunk_offset;
+		if(len > size - copied)
+			len = size - copied;
+		{
+			GSFS_PROFILE_SCOPE("memcpy");
+			memcpy(buf + copied, chunk->data + chunk_offset, len);
+		}
+		gsfs_put_song_audio(chunk);
+		copied += len;
+	}
+	
+	// only note chunks the stream moved on to, not every read of them
+	if(last != handle->logged_until)
+	{
+		gsfs_access_record(song, first, last);
+		handle->logged_until = last;
 	}
+	
+	if(!handle->first_read_done)
+	{
+		// this is the gap a listener hears between tracks
+		log_msg("    first read of \"%s\" after %.3f ms\n",
+			path, gsfs_elapsed_ms(&handle->opened));
+		handle->first_read_done = 1;
+	}
+	
+	// keep track of sequential playback, and once we're confident the
+	// song is being played through, warm up the next songs on the album
+	if(offset == handle->next_offset)
+		handle->sequential += copied;
+	else
+		handle->sequential = copied;
+	handle->next_offset = offset + copied;
+	
+	if(!handle->prefetched && handle->sequential >= gsfs_prefetch_threshold)
+	{
+		handle->prefetched = 1;
+		gsfs_prefetch_next_songs(song, handle->group);
+	}
+	
+	// read ahead of the stream, starting each chunk only once (unless
+	// the stream seeks somewhere else), and less of it under pressure
+	int num_chunks = gsfs_song_num_chunks(song);
+	int window = gsfs_readahead_window();
+	if(handle->readahead_until < last
+		|| handle->readahead_until > last + window)
+		handle->readahead_until = last;
+	while(handle->readahead_until < last + window
+		&& handle->readahead_until + 1 < num_chunks)
+	{
+		handle->readahead_until++;
+		gsfs_stream_readahead(handle->stream, song, handle->readahead_until);
+	}
+	
+	// tell the shaper how much audio is buffered past this read, so the
+	// streams closest to running dry are served first
+	int ahead = last + 1;
+	while(ahead < num_chunks && gsfs_song_chunk_ready(song, ahead))
+		ahead++;
+	off_t buffered_end = (off_t) ahead * GSFS_CHUNK_SIZE;
+	if(buffered_end > gsfs_song_size(song))
+		buffered_end = gsfs_song_size(song);
+	int bitrate = gsfs_song_bitrate(song);
+	if(bitrate <= 0)
+		bitrate = 128;
+	gsfs_stream_buffered(handle->stream,
+		(buffered_end - (offset + copied)) * 8 / bitrate);
+	
+	return tag_copied + copied;
 }
 
 /** Write data to an open file
@@ -437,8 +955,34 @@ int gsfs_read(const char *path, char *buf, size_t size, off_t offset, struct fus
 int gsfs_write(const char *path, const char *buf, size_t size, off_t offset,
 	     struct fuse_file_info *fi)
 {
+	GSFS_PROFILE_SCOPE(__func__);
     log_msg("\ngsfs_write(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)\n",
 	    path, buf, size, offset, fi);
+	
+	GSFS_File_Handle *handle = (GSFS_File_Handle *) fi->fh;
+	if(handle->control == CONTROL_DROP_CACHES)
+	{
+		gsfs_audio_drop_caches();
+		log_msg("    dropped the audio cache\n");
+		return size;
+	}
+	if(handle->control == CONTROL_PROFILE)
+	{
+		gsfs_profile_dump(gsfs_DATA->rootdir);
+		return size;
+	}
+	if(handle->control != CONTROL_NONE)
+	{
+		int error = gsfs_control_lines(handle, buf, size);
+		// a knob's value comes in a single write, newline or not, so
+		// it's checked and set now, where the writer sees the error
+		if(error == SUCCESS && handle->control == CONTROL_KNOB && handle->line_len > 0)
+			error = gsfs_control_lines(handle, "\n", 1);
+		if(error != SUCCESS)
+			return EINVAL;
+		return size;
+	}
+	
 	// files are read-only
     return EROFS;
 }
@@ -452,23 +996,31 @@ int gsfs_write(const char *path, const char *buf, size_t size, off_t offset,
  */
 int gsfs_statfs(const char *path, struct statvfs *statv)
 {
-	// Leave this as is. Since our file system currently runs in memory,
-	// the underlying filesystem statistics for our 'empty' music folder
-	// apply perfectly.
-    int retstat = 0;
-    char fpath[PATH_MAX];
-    
+	GSFS_PROFILE_SCOPE(__func__);
+	// Describe the audio cache rather than whatever rootdir is on: its
+	// capacity is the cache budget, in chunk-sized blocks, and every
+	// registered song is a file.
     log_msg("\ngsfs_statfs(path=\"%s\", statv=0x%08x)\n",
 	    path, statv);
-    gsfs_fullpath(fpath, path);
-    
-    // get stats for underlying filesystem
-    retstat = statvfs(fpath, statv);
-    if (retstat < 0)
-	retstat = gsfs_error("gsfs_statfs statvfs");
+	
+	size_t budget, used;
+	long songs;
+	gsfs_audio_usage(&budget, &used, &songs);
+	
+	memset(statv, 0, sizeof(struct statvfs));
+	statv->f_bsize = GSFS_CHUNK_SIZE;
+	statv->f_frsize = GSFS_CHUNK_SIZE;
+	statv->f_blocks = budget / GSFS_CHUNK_SIZE;
+	// admission can let reads run a little over budget
+	statv->f_bfree = used < budget ? (budget - used) / GSFS_CHUNK_SIZE : 0;
+	statv->f_bavail = statv->f_bfree;
+	statv->f_files = songs;
+	statv->f_ffree = 0;
+	statv->f_favail = 0;
+	statv->f_namemax = MAX_PATH - 1;
     
     log_statvfs(statv);
-    return retstat;
+    return SUCCESS;
 }
 
 /** Possibly flush cached data
@@ -499,6 +1051,12 @@ int gsfs_flush(const char *path, struct fuse_file_info *fi)
 	log_msg("\ngsfs_flush(path=\"%s\", fi=0x%08x)\n", path, fi);
     // no need to get fpath on this one, since I work from fi->fh not the path
     log_fi(fi);
+	
+	// the last line written to a control file needn't end in a newline;
+	// act on it here, where close() can still report an error
+	GSFS_File_Handle *handle = (GSFS_File_Handle *) fi->fh;
+	if(handle->control != CONTROL_NONE && handle->line_len > 0)
+		return gsfs_control_lines(handle, "\n", 1);
 
 	// I believe we should treat this as always-successful
 	// GSFS caches a lot of audio data, but we really don't want to erase
@@ -522,10 +1080,28 @@ int gsfs_flush(const char *path, struct fuse_file_info *fi)
  */
 int gsfs_release(const char *path, struct fuse_file_info *fi)
 {
+	GSFS_PROFILE_SCOPE(__func__);
     log_msg("\ngsfs_release(path=\"%s\", fi=0x%08x)\n",
 	  path, fi);
     log_fi(fi);
 	
+	// anything still queued on behalf of this stream is no longer wanted
+	GSFS_File_Handle *handle = (GSFS_File_Handle *) fi->fh;
+	gsfs_stream_free(handle->stream, path);
+	gsfs_job_group_cancel(handle->group);
+	
+	// in case we were never flushed
+	if(handle->control != CONTROL_NONE)
+		gsfs_control_lines(handle, "\n", 1);
+	else
+	{
+		if(handle->variant != NULL)
+			gsfs_put_variant(handle->variant);
+		gsfs_artist_unref(handle->song->album->artist);
+	}
+	free(handle->tag);
+	free(handle);
+	
 	// if we introduce more advanced caching mechanisms, we'll want to implement
 	// a garbage collector for cached audio data. Till then...
 	return SUCCESS;
@@ -559,20 +1135,133 @@ int gsfs_setxattr(const char *path, const char *name, const char *value, size_t
     return ENOTSUP;
 }
 
+// Song metadata is exposed as extended attributes, answered from the
+// catalog without fetching any audio, so media indexers needn't open
+// (and download) every song to learn what it is
+static const char *gsfs_xattr_names[] = {
+	"user.title",
+	"user.artist",
+	"user.album",
+	"user.track",
+	"user.duration",  // seconds
+	"user.bitrate"    // kbit/s
+};
+
+#define GSFS_NUM_XATTRS (sizeof(gsfs_xattr_names) / sizeof(gsfs_xattr_names[0]))
+
+// Format a song's ith attribute into value, returning its length, or -1
+// if we don't know it. Called inside gsfs_catalog_enter().
+static int gsfs_song_xattr(Song *song, int i, char value[MAX_PATH])
+{
+	Album *album = song->album;
+	Artist *artist = album->artist;
+	const char *name;
+	
+	// the first frame knows better than the catalog, once it has been seen
+	long duration = gsfs_song_duration_ms(song);
+	if(duration < 0)
+		duration = song->duration_ms;
+	
+	switch(i)
+	{
+	case 0:
+		name = gsfs_song_title(song);
+		if(name == NULL)
+			return -1;
+		return snprintf(value, MAX_PATH, "%s", name);
+	case 1:
+		return snprintf(value, MAX_PATH, "%s", artist->name);
+	case 2:
+		name = gsfs_album_name(album);
+		if(name == NULL)
+			return -1;
+		return snprintf(value, MAX_PATH, "%s", name);
+	case 3:
+		return snprintf(value, MAX_PATH, "%d", song->track_index + 1);
+	case 4:
+		if(duration <= 0)
+			return -1;
+		return snprintf(value, MAX_PATH, "%ld.%03ld", duration / 1000, duration % 1000);
+	case 5:
+		if(gsfs_song_bitrate(song) > 0)
+			return snprintf(value, MAX_PATH, "%d", gsfs_song_bitrate(song));
+		if(duration <= 0)
+			return -1;
+		return snprintf(value, MAX_PATH, "%ld", (long) (gsfs_song_size(song) * 8 / duration));
+	}
+	return -1;
+}
+
 /** Get extended attributes */
 int gsfs_getxattr(const char *path, const char *name, char *value, size_t size)
 {
+	GSFS_PROFILE_SCOPE(__func__);
     log_msg("\ngsfs_getxattr(path = \"%s\", name = \"%s\", value = 0x%08x, size = %d)\n",
 	    path, name, value, size);
-    return ENOTSUP;
+	
+	GSFS_Path_Components 
+		path_components = gsfs_parse_path(path);
+	
+	// only songs have attributes
+	if(path_components.level != SONG)
+		return ENODATA;
+	
+	int i = 0;
+	while(i < GSFS_NUM_XATTRS && strcmp(name, gsfs_xattr_names[i]) != 0)
+		i++;
+	if(i == GSFS_NUM_XATTRS)
+		return ENODATA;
+	
+	char attribute[MAX_PATH];
+	int len = -1;
+	
+	gsfs_catalog_enter();
+	GSFS_Query_FS_Result
+		result = gsfs_query_fs(path_components);
+	if(result.error == SUCCESS)
+		len = gsfs_song_xattr(result.song, i, attribute);
+	gsfs_catalog_exit();
+	
+	if(result.error != SUCCESS)
+		return ENOENT;
+	if(len < 0)
+		return ENODATA;
+	
+	// a size of zero asks how big the value is
+	if(size == 0)
+		return len;
+	if(len > size)
+		return ERANGE;
+	memcpy(value, attribute, len);
+	return len;
 }
 
 /** List extended attributes */
 int gsfs_listxattr(const char *path, char *list, size_t size)
 {
+	GSFS_PROFILE_SCOPE(__func__);
     log_msg("gsfs_listxattr(path=\"%s\", list=0x%08x, size=%d)\n",
 	    path, list, size);
-	return ENOTSUP;
+	
+	GSFS_Path_Components 
+		path_components = gsfs_parse_path(path);
+	
+	if(path_components.level != SONG)
+		return 0;
+	
+	size_t len = 0;
+	for(int i = 0; i < GSFS_NUM_XATTRS; i++)
+	{
+		size_t name_len = strlen(gsfs_xattr_names[i]) + 1;
+		if(size != 0)
+		{
+			if(len + name_len > size)
+				return ERANGE;
+			memcpy(list + len, gsfs_xattr_names[i], name_len);
+		}
+		len += name_len;
+	}
+	return len;
 }
 
 /** Remove extended attributes */
@@ -593,36 +1282,67 @@ int gsfs_removexattr(const char *path, const char *name)
  */
 int gsfs_opendir(const char *path, struct fuse_file_info *fi)
 {
+	GSFS_PROFILE_SCOPE(__func__);
     log_msg("\ngsfs_opendir(path=\"%s\", fi=0x%08x)\n",
 	  path, fi);
     
+	if(strcmp(path, GSFS_CONTROL_DIR) == 0)
+	{
+		GSFS_Dir_Handle *handle = calloc(1, sizeof(GSFS_Dir_Handle));
+		if(handle == NULL)
+			return ENOMEM;
+		handle->control = 1;
+		fi->fh = (uint64_t) handle;
+		return SUCCESS;
+	}
+	
 	GSFS_Path_Components 
 		path_components = gsfs_parse_path(path);
-		
-	switch(path_components.level){
-	case ROOT:
-		// always allow root to be opened
-		return SUCCESS;
-	case ARTIST:
-	case ALBUM: 
+	
+	// a song is not a directory
+	if(path_components.level == SONG)
+		return ENOTDIR;
+	
+	GSFS_Dir_Handle *handle = calloc(1, sizeof(GSFS_Dir_Handle));
+	if(handle == NULL)
+		return ENOMEM;
+	
+	// the listing comes from the catalog as it is right now, however
+	// it changes while the directory is open
+	handle->catalog = gsfs_catalog_pin();
+	
+	if(path_components.level != ROOT)
+	{
 		// artist and album must exist to be open
-		GSFS_Filesystem_Query_Result query_result;
-		switch(gsfs_fs_query(&query_result,
-			path_components.artist_name,
-			path_components.album_name))
+		gsfs_catalog_enter();
+		GSFS_Query_FS_Result result;
+		if(path_components.level == ARTIST)
 		{
-		case ERROR_ALBUM_NOT_FOUND:
-		case ERROR_ARTIST_NOT_FOUND:
-		case ERROR_ALBUM_NOT_FOUND:
+			result = gsfs_query_fs(path_components.artist_name);
+			handle->artist = result.artist;
+		}
+		else
+		{
+			result = gsfs_query_fs(path_components.artist_name, path_components.album_name);
+			if(result.error == SUCCESS)
+				handle->artist = result.album->artist;
+			handle->album = result.album;
+		}
+		if(result.error == SUCCESS)
+			gsfs_artist_ref(handle->artist);
+		gsfs_catalog_exit();
+		
+		if(result.error != SUCCESS)
+		{
+			gsfs_catalog_unpin(handle->catalog);
+			free(handle);
 			// error: no such file or directory
 			return ENOENT;
-		case SUCCESS:
-			return SUCCESS;
 		}
-	case SONG:
-		// error: a song is not a directory
-		return ENOTDIR;
 	}
+	
+	fi->fh = (uint64_t) handle;
+	return SUCCESS;
 }
 
 /** Read directory
@@ -646,7 +1366,6 @@ int gsfs_opendir(const char *path, struct fuse_file_info *fi)
  *
  * Introduced in version 2.3
  */
- /* TODO: lots of shit */
 int gsfs_readdir(
 	const char *path, 
 	void *buf, 
@@ -654,39 +1373,46 @@ int gsfs_readdir(
 	off_t offset,
 	struct fuse_file_info *fi)
 { 
+	GSFS_PROFILE_SCOPE(__func__);
     log_msg("\ngsfs_readdir(path=\"%s\", buf=0x%08x, filler=0x%08x, offset=%lld, fi=0x%08x)\n",
 	    path, buf, filler, offset, fi);
-		
-	GSFS_Path_Components 
-		path_components = gsfs_parse_path(path);
-		
-	switch(path_components.level){
-	case ROOT:
-		for(int i=0; i < gsfs_artists.length; i++)
-			filler(buf, gsfs_artists[i]->name, NULL, 0);
-		return SUCCESS;
-		
-	case ARTIST:
-		GSFS_Query_FS_Result 
-			result = gsfs_query_fs(path_components.artist_name);
-		if(result.error != 0)
-			return ENOENT;
-		for(int i=0; i < result.artist->length; i++)
-			filler(buf, result.artist->albums[i]->name, NULL, 0);
-		return SUCCESS;
-		
-	case ALBUM:
-		GSFS_Query_FS_Result
-			result = gsfs_query_fs(path_components.artist_name, path_components.album_name);
-		if(result.error != 0)
-			return ENOENT;
-		for(int i=0; i < result.album->length; i++)
-			filler(buf, result.album->songs[i]->name, NULL, 0);
-		return SUCCESS;
-	case SONG:
-		// error: a song is not a directory
-		return ENOTDIR;
+	
+	// everything we list was pinned by gsfs_opendir, so nothing can be
+	// freed while we walk it
+	GSFS_Dir_Handle *handle = (GSFS_Dir_Handle *) fi->fh;
+	
+	GSFS_Strtab_Cursor cursor;
+	int index;
+	
+	if(handle->control)
+	{
+		filler(buf, "register", NULL, 0);
+		filler(buf, "drop_caches", NULL, 0);
+#ifdef GSFS_PROFILE
+		filler(buf, "profile", NULL, 0);
+#endif
+		for(int i = 0; i < GSFS_NUM_KNOBS; i++)
+			filler(buf, gsfs_knobs[i].name, NULL, 0);
+	}
+	else if(handle->album != NULL)
+	{
+		gsfs_strtab_cursor_init(&cursor, handle->album->song_names);
+		while(gsfs_strtab_cursor_next(&cursor, &index))
+			filler(buf, cursor.name, NULL, 0);
+	}
+	else if(handle->artist != NULL)
+	{
+		gsfs_strtab_cursor_init(&cursor, handle->artist->album_names);
+		while(gsfs_strtab_cursor_next(&cursor, &index))
+			filler(buf, cursor.name, NULL, 0);
 	}
+	else
+	{
+		filler(buf, GSFS_CONTROL_DIR + 1, NULL, 0);
+		for(int i=0; i < handle->catalog->num_artists; i++)
+			filler(buf, handle->catalog->artists[i]->name, NULL, 0);
+	}
+	return SUCCESS;
 }
 
 /** Release directory
@@ -695,8 +1421,17 @@ int gsfs_readdir(
  */
 int gsfs_releasedir(const char *path, struct fuse_file_info *fi)
 {
+	GSFS_PROFILE_SCOPE(__func__);
     log_msg("\ngsfs_releasedir(path=\"%s\", fi=0x%08x)\n",
 	    path, fi);
+	
+	GSFS_Dir_Handle *handle = (GSFS_Dir_Handle *) fi->fh;
+	if(handle->artist != NULL)
+		gsfs_artist_unref(handle->artist);
+	if(handle->catalog != NULL)
+		gsfs_catalog_unpin(handle->catalog);
+	free(handle);
+	
     return SUCCESS;
 }
 
@@ -717,6 +1452,38 @@ int gsfs_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi)
     return SUCCESS;
 }
 
+// What gsfs_init() and gsfs_destroy() do besides logging is in
+// gsfs_start() and gsfs_stop(), which the soak build (see gsfs_soak.c)
+// calls itself, with nothing mounted.
+void gsfs_start(char *rootdir)
+{
+	// the rootdir we were mounted over holds the on-disk audio cache;
+	// GSFS_IO=threads picks the thread pool over io_uring, to compare
+	// the two or to get around a kernel whose io_uring misbehaves
+	const char *io = getenv("GSFS_IO");
+	gsfs_disk_cache_dir = rootdir;
+	if(gsfs_io_init(io == NULL || strcmp(io, "threads") != 0) != SUCCESS)
+		gsfs_disk_cache_dir = NULL;
+	else
+		gsfs_disk_cache_init();
+	
+	// warm the disk cache up with what was popular last time
+	if(gsfs_disk_cache_dir != NULL)
+		gsfs_history_init(gsfs_disk_cache_dir);
+}
+
+void gsfs_stop(char *rootdir)
+{
+	gsfs_history_close();
+	gsfs_audio_log_hits();
+	gsfs_audio_log_sharing();
+	gsfs_audio_log_admission();
+	gsfs_disk_cache_log();
+	gsfs_strtab_log_usage();
+	gsfs_fault_log();
+	gsfs_profile_dump(rootdir);
+}
+
 /**
  * Initialize filesystem
  *
@@ -741,6 +1508,8 @@ void *gsfs_init(struct fuse_conn_info *conn)
     log_conn(conn);
     log_fuse_context(fuse_get_context());
     
+	gsfs_start(gsfs_DATA->rootdir);
+	
     return gsfs_DATA;
 }
 
@@ -754,6 +1523,7 @@ void *gsfs_init(struct fuse_conn_info *conn)
 void gsfs_destroy(void *userdata)
 {
     log_msg("\ngsfs_destroy(userdata=0x%08x)\n", userdata);
+	gsfs_stop(gsfs_DATA->rootdir);
 }
 
 /**
@@ -769,25 +1539,37 @@ void gsfs_destroy(void *userdata)
  */
 int gsfs_access(const char *path, int mask)
 {
+	GSFS_PROFILE_SCOPE(__func__);
 	log_msg("\ngsfs_access(path=\"%s\", mask=0%o)\n",
 	    path, mask);
 		
+	GSFS_Knob *knob;
+	if(strcmp(path, GSFS_CONTROL_DIR) == 0
+		|| gsfs_control_file(path, &knob) != CONTROL_NONE)
+		return SUCCESS;
+	
 	GSFS_Path_Components 
 		path_components = gsfs_parse_path(path);
 		
 	GSFS_Query_FS_Result result;
 		
+	// the lookups walk the catalog, which a concurrent rmdir may be
+	// retiring
 	switch(path_components.level){
 	case ROOT:
 		return SUCCESS;
 	case ARTIST:
+		gsfs_catalog_enter();
 		result = gsfs_query_fs(path_components.artist_name);
+		gsfs_catalog_exit();
 		if(result.error != 0)
 			return ENOENT;
 		else 
 			return SUCCESS;
 	case ALBUM:
+		gsfs_catalog_enter();
 		result = gsfs_query_fs(path_components.artist_name, path_components.album_name);
+		gsfs_catalog_exit();
 		if(result.error != 0)
 			return ENOENT;
 		else
@@ -980,6 +1762,11 @@ int main(int argc, char *argv[])
     
     gsfs_data->logfile = log_open();
     
+#ifdef GSFS_SOAK
+    // nothing gets mounted; the soak drives the callbacks itself
+    return gsfs_soak(gsfs_data->rootdir, &gsfs_oper);
+#endif
+    
     // turn over control to fuse
     fprintf(stderr, "about to call fuse_main\n");
     fuse_stat = fuse_main(argc, argv, &gsfs_oper, gsfs_data);
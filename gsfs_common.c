@@ -1,10 +1,121 @@
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
 
+// Audio is fetched from grooveshark and cached in fixed-size chunks,
+// so a read at any offset only has to wait for the chunk it lands in
+#define GSFS_CHUNK_SIZE (256 * 1024)
 
+typedef enum {
+	CHUNK_EMPTY,
+	CHUNK_FETCHING,
+	CHUNK_READY
+} GSFS_Chunk_State;
+
+typedef struct GSFS_Audio_Chunk {
+	GSFS_Chunk_State state;
+	size_t len;
+	char * data;
+	int    pins;     // readers currently copying out of data
+	int    chances;  // passes through the LRU tail before eviction
+	struct GSFS_Audio_Chunk * lru_prev;
+	struct GSFS_Audio_Chunk * lru_next;
+} GSFS_Audio_Chunk;
+
+struct Album;
+struct GSFS_Audio;
+struct GSFS_Variant;
+
+// Songs and albums don't hold their own names; they're in a front-coded
+// table per directory (see gsfs_strtab.c), at the song's or album's index.
+// A name wanted for a tag or an attribute is decoded once and then kept
+// (see gsfs_song_title()), so only songs somebody looks at pay for it.
 typedef struct {
-	char name[MAX_PATH];
+	long   song_id;       // grooveshark song id
+	long   audio_id;      // grooveshark's id for the recording itself;
+	                      // 0 if it doesn't give one
+	size_t size;          // length of the audio in bytes
+	long   duration_ms;   // as grooveshark reports it; 0 if it doesn't
+	struct Album * album; // the album this song belongs to
+	int    track_index;   // position of this song in album->songs
+	unsigned int id3_length; // length of the tag served ahead of the audio
+	_Atomic(char *) title;   // decoded from album->song_names; NULL until wanted
+	struct GSFS_Audio * audio; // cached audio, shared by every song
+	                           // with the same recording
+	struct GSFS_Variant * variants; // transcoded copies of this song
+} Song;
+
+struct Artist;
+
+typedef struct Album {
+	struct Artist * artist; // the artist this album belongs to
+	long album_id;      // grooveshark album id
+	int  num_songs;
+	Song * songs;
+	GSFS_Strtab * song_names;
+	_Atomic(char *) name; // decoded from artist->album_names; NULL until wanted
+} Album;
+
+typedef struct Artist {
+	char * name;
 	int  num_albums;
 	Album * albums;
-}
+	GSFS_Strtab * album_names;
+	atomic_int refs;
+} Artist;
+
+// Fetch up to size bytes of a song's audio, starting at offset, into buf.
+// Provided by the grooveshark client; returns SUCCESS or
+// ERROR_CONNECTION_LOST, and stores the number of bytes fetched in len.
+int gsfs_fetch_audio(
+	long song_id,
+	off_t offset,
+	size_t size,
+	char *buf,
+	size_t *len);
+
+// Look an artist up by name. Provided by the grooveshark client; fills in
+// the artist's name as grooveshark spells it and its albums' ids, but not
+// their songs, and stores the albums' names in album_names. The name and
+// album names are allocated with malloc. Returns SUCCESS,
+// ERROR_ARTIST_NOT_FOUND or ERROR_CONNECTION_LOST.
+int gsfs_fetch_artist(
+	const char *name,
+	Artist *artist,
+	char ***album_names);
+
+// Fill in the songs (ids, audio ids, sizes and durations) of several
+// albums with a single request, storing album i's song names, allocated with malloc, in
+// song_names[i]. Provided by the grooveshark client; returns SUCCESS or
+// ERROR_CONNECTION_LOST.
+int gsfs_fetch_albums(
+	Album **albums,
+	int num_albums,
+	char ***song_names);
+
+// Times the rest of the enclosing scope under name, in the profiling
+// build (see gsfs_profile.c); otherwise nothing
+#ifdef GSFS_PROFILE
+int  gsfs_profile_enter(const char *name);
+void gsfs_profile_exit(int *scope);
+#define GSFS_PROFILE_SCOPE(name) \
+	int gsfs_profile_scope __attribute__((cleanup(gsfs_profile_exit), unused)) \
+		= gsfs_profile_enter(name)
+#else
+#define GSFS_PROFILE_SCOPE(name)
+#endif
 
 
 typedef struct {
@@ -17,45 +128,696 @@ typedef struct {
 } GSFS_Query_FS_Result;
 
 
-GSFS_Query_FS_Result gsfs_query_fs(
-	char *artist_name)
+// The catalog is copy-on-write. Readers pin the current version and
+// can iterate it for as long as they like; writers build a new version
+// and publish it, never touching one a reader might hold. Artists are
+// reference counted (every version that lists an artist holds a
+// reference, as does anything else that must keep it alive, like an open
+// file or directory) and are freed along with their audio once the last
+// reference is dropped.
+//
+// Retired versions are reclaimed epoch-style: a reader marks itself as
+// active in the current epoch for just long enough to load the current
+// version and take a reference to it, and a retired version only loses
+// the catalog's reference once no reader that might have loaded it is
+// still active. Readers never wait on writers.
+typedef struct GSFS_Catalog {
+	atomic_int refs;
+	int      num_artists;
+	Artist **artists;
+	unsigned long retired_epoch;
+	struct GSFS_Catalog *next_retired;
+} GSFS_Catalog;
+
+// How many threads can be reading the catalog at the same moment
+#define GSFS_MAX_READERS 256
+
+// The empty catalog we start with holds an extra reference so that it
+// is never freed
+static GSFS_Catalog gsfs_empty_catalog = { 2, 0, NULL, 0, NULL };
+static _Atomic(GSFS_Catalog *) gsfs_catalog = &gsfs_empty_catalog;
+static GSFS_Catalog *gsfs_retired_catalogs = NULL;
+
+// Writers (and reclamation) are serialized by gsfs_catalog_lock
+static pthread_mutex_t gsfs_catalog_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// A thread reading the catalog holds a slot, holding the epoch it
+// entered in, for as long as it's reading; the slot is given back when
+// it leaves, so only threads reading at the same moment compete for them.
+static atomic_ulong gsfs_epoch = 1;
+static atomic_ulong gsfs_reader_epochs[GSFS_MAX_READERS];
+static atomic_int   gsfs_reader_owned[GSFS_MAX_READERS];
+static __thread int gsfs_reader_slot = -1;
+static __thread int gsfs_reader_hint = -1; // where to look for one first
+static __thread int gsfs_reader_depth = 0;
+
+void gsfs_artist_ref(Artist *artist)
 {
-	GSFS_Query_FS_Result result;
+	atomic_fetch_add(&artist->refs, 1);
+}
+
+void gsfs_artist_unref(Artist *artist)
+{
+	if(atomic_fetch_sub(&artist->refs, 1) == 1)
+		gsfs_free_artist(artist);
+}
+
+// Begin a read-side critical section. Artists found through the name
+// index stay valid until the matching gsfs_catalog_exit(); take a
+// reference to keep one any longer than that.
+void gsfs_catalog_enter(void)
+{
+	if(gsfs_reader_depth++ > 0)
+		return;
 	
-	result.error = ARTIST_NOT_FOUND;
+	// claim a slot, starting with the one we had last time, which is
+	// most likely free; if every one is taken, wait for a reader to leave
+	if(gsfs_reader_hint < 0)
+		gsfs_reader_hint = (unsigned long) pthread_self() % GSFS_MAX_READERS;
+	for(int i = gsfs_reader_hint, tried = 0; gsfs_reader_slot < 0; i = (i + 1) % GSFS_MAX_READERS)
+	{
+		int expected = 0;
+		if(atomic_compare_exchange_strong(&gsfs_reader_owned[i], &expected, 1))
+			gsfs_reader_slot = i;
+		else if(++tried % GSFS_MAX_READERS == 0)
+			sched_yield();
+	}
+	gsfs_reader_hint = gsfs_reader_slot;
+	
+	atomic_store(&gsfs_reader_epochs[gsfs_reader_slot], atomic_load(&gsfs_epoch));
+}
+
+void gsfs_catalog_exit(void)
+{
+	if(--gsfs_reader_depth > 0)
+		return;
+	atomic_store(&gsfs_reader_epochs[gsfs_reader_slot], 0);
+	atomic_store(&gsfs_reader_owned[gsfs_reader_slot], 0);
+	gsfs_reader_slot = -1;
+}
+
+// Pin the current catalog version; it won't change or go away until it
+// is unpinned
+GSFS_Catalog *gsfs_catalog_pin(void)
+{
+	gsfs_catalog_enter();
+	GSFS_Catalog *catalog = atomic_load(&gsfs_catalog);
+	atomic_fetch_add(&catalog->refs, 1);
+	gsfs_catalog_exit();
+	return catalog;
+}
+
+static void gsfs_catalog_free(GSFS_Catalog *catalog)
+{
+	for(int i = 0; i < catalog->num_artists; i++)
+		gsfs_artist_unref(catalog->artists[i]);
+	free(catalog->artists);
+	free(catalog);
+}
+
+// Drop the catalog's own reference to every retired version no reader
+// can still be in the middle of pinning. Called with gsfs_catalog_lock held.
+static void gsfs_catalog_reclaim(void)
+{
+	unsigned long oldest = 0;
+	for(int i = 0; i < GSFS_MAX_READERS; i++)
+	{
+		unsigned long epoch = atomic_load(&gsfs_reader_epochs[i]);
+		if(epoch != 0 && (oldest == 0 || epoch < oldest))
+			oldest = epoch;
+	}
+	
+	GSFS_Catalog **retired = &gsfs_retired_catalogs;
+	while(*retired != NULL)
+	{
+		GSFS_Catalog *catalog = *retired;
+		if(oldest == 0 || oldest > catalog->retired_epoch)
+		{
+			*retired = catalog->next_retired;
+			if(atomic_fetch_sub(&catalog->refs, 1) == 1)
+				gsfs_catalog_free(catalog);
+		}
+		else
+			retired = &(catalog->next_retired);
+	}
+}
+
+void gsfs_catalog_unpin(GSFS_Catalog *catalog)
+{
+	if(atomic_fetch_sub(&catalog->refs, 1) == 1)
+		gsfs_catalog_free(catalog);
+	
+	// a good moment to clean up after writers, if none is busy
+	if(gsfs_retired_catalogs != NULL && pthread_mutex_trylock(&gsfs_catalog_lock) == 0)
+	{
+		gsfs_catalog_reclaim();
+		pthread_mutex_unlock(&gsfs_catalog_lock);
+	}
+}
+
+// Publish a new catalog version listing the current artists, plus added
+// (if not NULL) and minus removed (if not NULL). Called with
+// gsfs_catalog_lock held.
+static int gsfs_catalog_publish(Artist *added, Artist *removed)
+{
+	GSFS_Catalog *old = atomic_load(&gsfs_catalog);
+	GSFS_Catalog *new = calloc(1, sizeof(GSFS_Catalog));
+	if(new == NULL)
+		return ENOMEM;
+	
+	new->artists = malloc((old->num_artists + 1) * sizeof(Artist *));
+	if(new->artists == NULL)
+	{
+		free(new);
+		return ENOMEM;
+	}
+	
+	for(int i = 0; i < old->num_artists; i++)
+		if(old->artists[i] != removed)
+			new->artists[new->num_artists++] = old->artists[i];
+	if(added != NULL)
+		new->artists[new->num_artists++] = added;
+	
+	for(int i = 0; i < new->num_artists; i++)
+		gsfs_artist_ref(new->artists[i]);
+	atomic_init(&new->refs, 1);
+	
+	atomic_store(&gsfs_catalog, new);
+	old->retired_epoch = atomic_fetch_add(&gsfs_epoch, 1);
+	old->next_retired = gsfs_retired_catalogs;
+	gsfs_retired_catalogs = old;
+	
+	gsfs_catalog_reclaim();
+	return SUCCESS;
+}
+
+// Add a freshly registered artist to the catalog. The catalog takes over
+// the caller's reference. alias (if not NULL) is the name the artist was
+// asked for by, which needn't normalize to grooveshark's spelling of it;
+// it's made to lead to the artist too, or to whichever registration of
+// it got there first.
+int gsfs_catalog_add_artist(Artist *artist, const char *alias)
+{
+	pthread_mutex_lock(&gsfs_catalog_lock);
+	
+	// two registrations of the same artist can race; the first one wins
+	int error = EEXIST;
+	Artist *registered = gsfs_name_index_lookup(artist->name);
+	if(registered == NULL)
+		error = gsfs_name_index_add(artist->name, artist);
+	if(error == SUCCESS)
+	{
+		error = gsfs_catalog_publish(artist, NULL);
+		if(error == SUCCESS)
+			registered = artist;
+		else
+			gsfs_name_index_free(gsfs_name_index_remove(artist));
+	}
+	
+	if(alias != NULL && registered != NULL && gsfs_name_index_lookup(alias) == NULL)
+		gsfs_name_index_add(alias, registered);
+	
+	pthread_mutex_unlock(&gsfs_catalog_lock);
+	
+	// the new version took its own reference
+	if(error == SUCCESS)
+		gsfs_artist_unref(artist);
+	return error;
+}
+
+// Let an artist be looked up by another name as well
+void gsfs_catalog_alias_artist(const char *alias, const char *name)
+{
+	pthread_mutex_lock(&gsfs_catalog_lock);
+	Artist *artist = gsfs_name_index_lookup(name);
+	if(artist != NULL)
+		gsfs_name_index_add(alias, artist);
+	pthread_mutex_unlock(&gsfs_catalog_lock);
+}
+
+// Take an artist out of the catalog. Whoever still has it pinned keeps
+// seeing it until they let go.
+int gsfs_deregister_artist(const char *name)
+{
+	int error = ERROR_ARTIST_NOT_FOUND;
+	
+	pthread_mutex_lock(&gsfs_catalog_lock);
+	
+	Artist *artist = gsfs_name_index_lookup(name);
+	if(artist != NULL)
+	{
+		// out of the index first: once the new version is published the
+		// artist may be reclaimed, and nothing must find it by name then
+		struct GSFS_Name_Entry *removed = gsfs_name_index_remove(artist);
+		error = gsfs_catalog_publish(NULL, artist);
+		if(error == SUCCESS)
+			gsfs_name_index_free(removed);
+		else
+			gsfs_name_index_restore(removed);
+	}
+	
+	pthread_mutex_unlock(&gsfs_catalog_lock);
+	return error;
+}
+
+// Also frees artists whose registration failed part way, so any of
+// their albums and songs may be missing
+void gsfs_free_artist(Artist *artist)
+{
+	for(int i = 0; artist->albums != NULL && i < artist->num_albums; i++)
+	{
+		Album *album = &(artist->albums[i]);
+		for(int j = 0; album->songs != NULL && j < album->num_songs; j++)
+		{
+			Song *song = &(album->songs[j]);
+			gsfs_free_variants(song);
+			if(song->audio != NULL)
+				gsfs_audio_release(song);
+			free(atomic_load(&song->title));
+		}
+		free(album->songs);
+		gsfs_strtab_free(album->song_names);
+		free(atomic_load(&album->name));
+	}
+	free(artist->albums);
+	gsfs_strtab_free(artist->album_names);
+	free(artist->name);
+	free(artist);
+}
+
+// Bulk registration: every line written to the /.gsfs/register control file
+// names an artist to register in the background. Reading the file
+// reports how far along we are.
+atomic_int gsfs_bulk_queued = 0;
+atomic_int gsfs_bulk_registered = 0;
+atomic_int gsfs_bulk_failed = 0;
+
+static void gsfs_bulk_count(int error)
+{
+	// somebody else registering the artist first is as good
+	if(error == SUCCESS || error == EEXIST)
+		atomic_fetch_add(&gsfs_bulk_registered, 1);
+	else
+		atomic_fetch_add(&gsfs_bulk_failed, 1);
+}
+
+// Registering an artist takes one request for the artist and its album
+// list, then the albums' songs are fetched GSFS_METADATA_BATCH albums to
+// a request. Every batch is its own registration job, so a registration's
+// batches are in flight together (as many at once as the scheduler's
+// registration cap allows) rather than one after another.
+#define GSFS_METADATA_BATCH 25
+
+typedef struct {
+	Artist *artist;
+	atomic_int pending;    // batches not yet back
+	atomic_int error;
+	
+	// somebody may be waiting on the registration to finish
+	pthread_mutex_t lock;
+	pthread_cond_t  cond;
+	int done;
+	int waited;            // if not, the last batch cleans up
+	char alias[MAX_PATH];  // the name asked for, if not grooveshark's
+} GSFS_Registration;
+
+typedef struct {
+	GSFS_Registration *registration;
+	int first;
+	int num_albums;
+} GSFS_Batch_Job;
+
+// Called as each batch comes back; the last one publishes the artist
+static void gsfs_registration_batch_done(GSFS_Registration *registration)
+{
+	if(atomic_fetch_sub(&registration->pending, 1) != 1)
+		return;
+	
+	Artist *artist = registration->artist;
+	int error = atomic_load(&registration->error);
+	
+	// a partially populated artist is no use to anybody
+	if(error == SUCCESS)
+		error = gsfs_catalog_add_artist(artist,
+			registration->alias[0] != '\0' ? registration->alias : NULL);
+	if(error != SUCCESS)
+		gsfs_free_artist(artist);
+	
+	pthread_mutex_lock(&registration->lock);
+	registration->error = error;
+	registration->done = 1;
+	int waited = registration->waited;
+	pthread_cond_signal(&registration->cond);
+	pthread_mutex_unlock(&registration->lock);
+	
+	if(!waited)
+	{
+		gsfs_bulk_count(error);
+		free(registration);
+	}
+}
+
+// A name out of a table, decoded the first time it's wanted and kept
+// from then on; NULL if we're out of memory
+static const char *gsfs_cached_name(_Atomic(char *) *cache, GSFS_Strtab *table, int index)
+{
+	char *name = atomic_load(cache);
+	if(name != NULL)
+		return name;
+	
+	char decoded[MAX_PATH];
+	if(gsfs_strtab_name(table, index, decoded) != SUCCESS
+		|| (name = strdup(decoded)) == NULL)
+		return NULL;
+	
+	// somebody else may have decoded it meanwhile
+	char *expected = NULL;
+	if(!atomic_compare_exchange_strong(cache, &expected, name))
+	{
+		free(name);
+		name = expected;
+	}
+	return name;
+}
+
+// A song's and an album's names, for tags and attributes. Called inside
+// gsfs_catalog_enter(), or with a reference to the artist.
+const char *gsfs_song_title(Song *song)
+{
+	return gsfs_cached_name(&song->title, song->album->song_names, song->track_index);
+}
+
+const char *gsfs_album_name(Album *album)
+{
+	Artist *artist = album->artist;
+	return gsfs_cached_name(&album->name, artist->album_names, album - artist->albums);
+}
+
+// The fields of the ID3 tag served in front of a song, given its title
+// and its album's name
+static size_t gsfs_song_id3(Song *song, const char *title, const char *album_name, unsigned char *out)
+{
+	// only the catalog's duration, not the first frame's: the tag mustn't
+	// change size once the song has been looked at
+	return gsfs_id3_tag(out, title != NULL ? title : "", song->album->artist->name,
+		album_name != NULL ? album_name : "", song->track_index + 1, song->duration_ms);
+}
+
+// Worked out once, when the song is registered, since getattr wants it
+// every time the song is looked at
+size_t gsfs_song_id3_length(Song *song)
+{
+	return song->id3_length;
+}
+
+// Build a song's tag in a buffer of its own; NULL if we're out of memory
+unsigned char *gsfs_song_id3_tag(Song *song, size_t *len)
+{
+	*len = song->id3_length;
+	unsigned char *tag = malloc(*len);
+	if(tag != NULL)
+		gsfs_song_id3(song, gsfs_song_title(song), gsfs_album_name(song->album), tag);
+	return tag;
+}
+
+static void gsfs_batch_job(void *arg, int cancelled)
+{
+	GSFS_PROFILE_SCOPE(__func__);
+	GSFS_Batch_Job *job = arg;
+	GSFS_Registration *registration = job->registration;
+	Artist *artist = registration->artist;
+	Album *albums[GSFS_METADATA_BATCH];
+	char **song_names[GSFS_METADATA_BATCH] = { NULL };
+	
+	for(int i = 0; i < job->num_albums; i++)
+		albums[i] = &(artist->albums[job->first + i]);
+	
+	int error = ERROR_CONNECTION_LOST;
+	if(!cancelled && atomic_load(&registration->error) == SUCCESS)
+		error = gsfs_fault_request();
+	if(error == SUCCESS)
+	{
+		GSFS_PROFILE_SCOPE("gsfs_fetch_albums");
+		error = gsfs_fetch_albums(albums, job->num_albums, song_names);
+	}
+	
+	for(int i = 0; error == SUCCESS && i < job->num_albums; i++)
+	{
+		albums[i]->song_names = gsfs_strtab_build(song_names[i], albums[i]->num_songs);
+		if(albums[i]->song_names == NULL)
+			error = ENOMEM;
+		
+		// the tags' lengths come from the names as grooveshark gave them,
+		// rather than decoding every song's out of the table again
+		char album_name[MAX_PATH] = "";
+		gsfs_strtab_name(artist->album_names, albums[i] - artist->albums, album_name);
+		
+		for(int j = 0; error == SUCCESS && j < albums[i]->num_songs; j++)
+		{
+			Song *song = &(albums[i]->songs[j]);
+			song->album = albums[i];
+			song->track_index = j;
+			atomic_init(&song->title, NULL);
+			// cut short as the table cuts it, so the tag built from the
+			// decoded name later comes out the same length
+			char title[MAX_PATH];
+			snprintf(title, MAX_PATH, "%s", song_names[i][j]);
+			song->id3_length = gsfs_song_id3(song, title, album_name, NULL);
+			error = gsfs_audio_acquire(song);
+		}
+	}
+	
+	for(int i = 0; i < job->num_albums; i++)
+		gsfs_free_names(song_names[i], albums[i]->num_songs);
+	
+	if(error != SUCCESS)
+	{
+		int expected = SUCCESS;
+		atomic_compare_exchange_strong(&registration->error, &expected, error);
+	}
+	
+	free(job);
+	gsfs_registration_batch_done(registration);
+}
+
+// Register an artist by name, also to be found by alias (if not NULL;
+// see gsfs_catalog_add_artist()). If wait is set, returns once the artist
+// is in the catalog (or registration failed). Otherwise this is a bulk
+// registration: it returns as soon as the album batches are queued, and
+// the outcome is only reported through the bulk counters.
+int gsfs_register_artist(const char *name, const char *alias, int wait)
+{
+	int error = ENOMEM;
+	char **album_names = NULL;
+	Artist *artist = gsfs_fault_calloc(1, sizeof(Artist));
+	if(artist != NULL)
+	{
+		atomic_init(&artist->refs, 1);
+		error = gsfs_fault_request();
+		if(error == SUCCESS)
+		{
+			GSFS_PROFILE_SCOPE("gsfs_fetch_artist");
+			error = gsfs_fetch_artist(name, artist, &album_names);
+		}
+		if(error == SUCCESS)
+		{
+			for(int i = 0; i < artist->num_albums; i++)
+			{
+				artist->albums[i].artist = artist;
+				atomic_init(&artist->albums[i].name, NULL);
+			}
+			artist->album_names = gsfs_strtab_build(album_names, artist->num_albums);
+			if(artist->album_names == NULL)
+				error = ENOMEM;
+		}
+		gsfs_free_names(album_names, artist->num_albums);
+	}
+	
+	// a single request was enough
+	if(error == SUCCESS && artist->num_albums == 0)
+		error = gsfs_catalog_add_artist(artist, alias);
+	
+	GSFS_Registration *registration = NULL;
+	if(error == SUCCESS && artist->num_albums > 0)
+	{
+		registration = gsfs_fault_calloc(1, sizeof(GSFS_Registration));
+		if(registration == NULL)
+			error = ENOMEM;
+	}
 	
-	for(int i=0; i<artists.length; i++)
+	if(registration == NULL)
 	{
-		if (strcmp(artist[i].name, artist_name) == 0)
+		if(error != SUCCESS && artist != NULL)
+			gsfs_free_artist(artist);
+		// failures are left for the caller to count; it may yet try
+		// another name
+		if(!wait && error == SUCCESS)
+			gsfs_bulk_count(error);
+		return error;
+	}
+	registration->artist = artist;
+	registration->waited = wait;
+	if(alias != NULL)
+		strncpy(registration->alias, alias, MAX_PATH - 1);
+	pthread_mutex_init(&registration->lock, NULL);
+	pthread_cond_init(&registration->cond, NULL);
+	
+	int num_batches = (artist->num_albums + GSFS_METADATA_BATCH - 1) / GSFS_METADATA_BATCH;
+	atomic_init(&registration->pending, num_batches);
+	atomic_init(&registration->error, SUCCESS);
+	
+	for(int i = 0; i < num_batches; i++)
+	{
+		GSFS_Batch_Job *job = gsfs_fault_calloc(1, sizeof(GSFS_Batch_Job));
+		if(job == NULL)
 		{
-			result.artist = &(artist[i]);
-			result.error = SUCCESS;
+			// fail the registration, but let the batches already queued
+			// (and this one) come back first
+			int expected = SUCCESS;
+			atomic_compare_exchange_strong(&registration->error, &expected, ENOMEM);
+			for(; i < num_batches; i++)
+				gsfs_registration_batch_done(registration);
 			break;
 		}
+		job->registration = registration;
+		job->first = i * GSFS_METADATA_BATCH;
+		job->num_albums = artist->num_albums - job->first;
+		if(job->num_albums > GSFS_METADATA_BATCH)
+			job->num_albums = GSFS_METADATA_BATCH;
+		
+		gsfs_sched_submit(GSFS_PRIO_REGISTRATION, NULL, gsfs_batch_job, job);
+	}
+	
+	if(!wait)
+		return SUCCESS;
+	
+	pthread_mutex_lock(&registration->lock);
+	while(!registration->done)
+		pthread_cond_wait(&registration->cond, &registration->lock);
+	error = registration->error;
+	pthread_mutex_unlock(&registration->lock);
+	
+	free(registration);
+	return error;
+}
+
+
+// Register an artist by a name somebody typed. The name is put to
+// grooveshark as it was given; only once grooveshark has turned it down
+// (just now, or recently enough to remember) is the nearest name it has
+// confirmed before tried instead, and then the typed name is made to lead
+// to that artist whether or not it was registered already. Returns EEXIST
+// only when the typed name itself is taken.
+int gsfs_register_artist_by_name(const char *name, int wait)
+{
+	char canonical[MAX_PATH], registered[MAX_PATH];
+	int error = ERROR_ARTIST_NOT_FOUND;
+	
+	switch(gsfs_resolve_artist_name(name, registered))
+	{
+	case NAME_REGISTERED:
+		return EEXIST;
+	case NAME_UNKNOWN:
+		// grooveshark's spelling may not normalize to what was typed,
+		// so the typed name is indexed as well
+		error = gsfs_register_artist(name, name, wait);
+		if(error != ERROR_ARTIST_NOT_FOUND)
+			return error;
+		gsfs_name_reject(name);
+		break;
+	case NAME_REJECTED:
+		break;
+	}
+	
+	if(!gsfs_name_correct(name, canonical))
+		return error;
+	
+	if(gsfs_resolve_artist_name(canonical, registered) != NAME_REGISTERED)
+	{
+		// a registration aliases the typed name itself once it's in
+		error = gsfs_register_artist(canonical, name, wait);
+		if(!wait || (error != SUCCESS && error != EEXIST))
+			return error;
+	}
+	
+	// FUSE looks a new directory up by the name it was created with, so
+	// make sure that name leads to the artist too, registered just now
+	// or not
+	gsfs_catalog_alias_artist(name, canonical);
+	return SUCCESS;
+}
+
+static void gsfs_bulk_register_job(void *arg, int cancelled)
+{
+	char *name = arg;
+	
+	if(cancelled)
+		gsfs_bulk_count(ECANCELED);
+	else
+	{
+		// registrations left running count themselves when they finish
+		int error = gsfs_register_artist_by_name(name, 0);
+		if(error != SUCCESS)
+			gsfs_bulk_count(error);
+	}
+	
+	free(name);
+}
+
+// Queue one artist name for bulk registration
+void gsfs_bulk_register(const char *name)
+{
+	atomic_fetch_add(&gsfs_bulk_queued, 1);
+	
+	char *copy = strdup(name);
+	if(copy == NULL)
+	{
+		gsfs_bulk_count(ENOMEM);
+		return;
 	}
+	
+	gsfs_sched_submit(GSFS_PRIO_REGISTRATION, NULL, gsfs_bulk_register_job, copy);
+}
+
+// Find an artist, album or song by name. The pointers returned are only
+// safe to follow inside gsfs_catalog_enter()/gsfs_catalog_exit(), or
+// after taking a reference to the artist.
+GSFS_Query_FS_Result gsfs_query_fs(
+	char *artist_name)
+{
+	GSFS_PROFILE_SCOPE("gsfs_query_fs/artist");
+	GSFS_Query_FS_Result result;
+	
+	result.error = ARTIST_NOT_FOUND;
+	
+	// "daft punk", "Daft Punk" and "Daft Punk " are all the same artist
+	result.artist = gsfs_name_index_lookup(artist_name);
+	if(result.artist != NULL)
+		result.error = SUCCESS;
+	
+	return result;
 }
 
 GSFS_Query_FS_Result gsfs_query_fs(
 	char *artist_name,
 	char *album_name)
 {
+	GSFS_PROFILE_SCOPE("gsfs_query_fs/album");
 	GSFS_Query_FS_Result result;
 	result = gsfs_query_fs(artist_name);
 	
 	if(result.error != 0)
 		return result;
 	
-	result.error = ALBUM_NOT_FOUND;
-	
-	for(int i=0; i<result.artist.length; i++)
+	int index = gsfs_strtab_find(result.artist->album_names, album_name);
+	if(index < 0)
 	{
-		if (strcmp(artist.album[i]->name, album_name) == 0)
-		{
-			result.album = &(album[i]);
-			result.error = SUCCESS;
-			break;
-		}
+		result.error = ALBUM_NOT_FOUND;
+		return result;
 	}
+	
+	result.album = &(result.artist->albums[index]);
+	return result;
 }		
 
 GSFS_Query_FS_Result gsfs_query_fs(
@@ -63,28 +825,21 @@ GSFS_Query_FS_Result gsfs_query_fs(
 	char *album_name,
 	char *song_name)
 {
+	GSFS_PROFILE_SCOPE("gsfs_query_fs/song");
 	GSFS_Query_FS_Result result;
 	
-	result = gsfs_query_fs(artist_name);
-	if(result.error != 0)
-		return result;
-		
-	result = gsfs_query_fs(result.artist, album_name);
+	result = gsfs_query_fs(artist_name, album_name);
 	if(result.error != 0)
 		return result;
 	
-	result.error = SONG_NOT_FOUND;
-	
-	for(int i=0; i<result.album.length; i++)
+	int index = gsfs_strtab_find(result.album->song_names, song_name);
+	if(index < 0)
 	{
-		if (strcmp(album.song[i]->name, song_name) == 0)
-		{
-			result.song = &(song[i]);
-			result.error = SUCCESS;
-			break;
-		}
+		result.error = SONG_NOT_FOUND;
+		return result;
 	}
 	
+	result.song = &(result.album->songs[index]);
 	return result;
 }
 
@@ -103,15 +858,20 @@ typedef enum {
 // parsed down to. So if the raw path is just "/", the
 // level is "ROOT". If it's "/Daft Punk/", the level
 // is ARTIST
+// Songs may also be requested at a lower bitrate, as
+// "/[artist]/[album]/[song].128k.mp3"; the bitrate is 0 when the
+// original audio was asked for.
 typedef struct {
 	GSFS_Path_Level level;
 	char artist_name[MAX_PATH];
 	char album_name[MAX_PATH];
 	char song_name[MAX_PATH];
+	int  bitrate;
 } GSFS_Path_Components;
 
 // a function to break the raw path up into pieces
 GSFS_Path_Components gsfs_parse_path(char* path) {
+	GSFS_PROFILE_SCOPE(__func__);
 	// declare a component struct
 	GSFS_Path_Components components;
 	// i refers to the index we're using for the raw path
@@ -122,6 +882,7 @@ GSFS_Path_Components gsfs_parse_path(char* path) {
 	unsigned int j = 0;
 	
 	components.level = ROOT;
+	components.bitrate = 0;
 	
 	char *target = &artist_name;
 	
@@ -156,5 +917,1264 @@ GSFS_Path_Components gsfs_parse_path(char* path) {
 		components.song_name[j-3] = '\0'; // 'm'
 		components.song_name[j-2] = '\0'; // 'p'
 		components.song_name[j-1] = '\0'; // '3'
+		
+		// if what's left ends in ".[bitrate]k", a transcoded variant
+		// of the song is wanted
+		char *suffix = strrchr(components.song_name, '.');
+		if(suffix != NULL)
+		{
+			char *end;
+			long bitrate = strtol(suffix + 1, &end, 10);
+			if(end != suffix + 1 && strcmp(end, "k") == 0
+				&& gsfs_variant_bitrate_supported(bitrate))
+			{
+				components.bitrate = bitrate;
+				*suffix = '\0';
+			}
+		}
 	}	
-}
\ No newline at end of file
+}
+
+// Number of chunks needed to hold size bytes of audio
+static int gsfs_num_chunks(size_t size)
+{
+	return (size + GSFS_CHUNK_SIZE - 1) / GSFS_CHUNK_SIZE;
+}
+
+// Total bytes of audio held in chunks, and the most we are willing to
+// hold. Guarded by gsfs_audio_lock; gsfs_audio_cond is signalled whenever
+// a chunk finishes fetching.
+static pthread_mutex_t gsfs_audio_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  gsfs_audio_cond = PTHREAD_COND_INITIALIZER;
+size_t gsfs_audio_bytes = 0;
+size_t gsfs_audio_budget = 256 * 1024 * 1024;
+
+// Audio is cached per recording rather than per song. The same recording
+// turns up on albums, compilations and deluxe editions; every song with
+// the same audio id shares one GSFS_Audio, so it is only fetched and
+// cached once. A song grooveshark gives no audio id for gets a
+// GSFS_Audio of its own, keyed on its song id instead. Song ids and audio
+// ids are numbered independently, so the key says which it is.
+typedef enum {
+	AUDIO_KEY_RECORDING,
+	AUDIO_KEY_SONG
+} GSFS_Audio_Key_Kind;
+
+typedef struct {
+	GSFS_Audio_Key_Kind kind;
+	long id;
+} GSFS_Audio_Key;
+
+static GSFS_Audio_Key gsfs_audio_key(long audio_id, long song_id)
+{
+	GSFS_Audio_Key key = { AUDIO_KEY_RECORDING, audio_id };
+	if(audio_id == 0)
+	{
+		key.kind = AUDIO_KEY_SONG;
+		key.id = song_id;
+	}
+	return key;
+}
+
+static unsigned long gsfs_audio_key_hash(GSFS_Audio_Key key)
+{
+	return (unsigned long) key.id * 2 + key.kind;
+}
+
+// The cached audio itself. Guarded by gsfs_audio_lock.
+typedef struct GSFS_Audio {
+	GSFS_Audio_Key key;
+	long   song_id;     // one of the songs, to ask grooveshark for it by
+	size_t size;
+	int    songs;       // how many songs share this recording
+	GSFS_Audio_Chunk * chunks;
+	struct GSFS_MP3_Info * mp3; // what its first frame says (see gsfs_mp3.c)
+	off_t  tag_end;     // where the audio starts past grooveshark's ID3 tag, or -1
+	int    mp3_tried;   // whether the chunk that frame is in has been looked at
+	struct GSFS_Audio * next;
+} GSFS_Audio;
+
+#define GSFS_AUDIO_BUCKETS 4096
+
+static GSFS_Audio *gsfs_audio_table[GSFS_AUDIO_BUCKETS];
+
+// A song's length is its recording's: songs sharing a recording may have
+// been listed with slightly different sizes, but they all read the same
+// chunks, so reads are bounded by the audio actually cached
+size_t gsfs_song_size(Song *song)
+{
+	return song->audio->size;
+}
+
+// Number of chunks needed to hold the song's audio
+int gsfs_song_num_chunks(Song *song)
+{
+	return gsfs_num_chunks(song->audio->size);
+}
+
+// How much audio the catalog lists, and how much of it is unique; the
+// difference is what sharing saves
+size_t gsfs_catalog_audio_bytes = 0;
+size_t gsfs_unique_audio_bytes = 0;
+
+// How many songs are registered, for statfs
+long gsfs_catalog_songs = 0;
+
+// Cached chunks, most recently used first. When the cache goes over
+// budget, chunks are evicted from the tail, except that a chunk shared by
+// several songs gets one more pass through the list for each extra song,
+// and pinned chunks are never evicted.
+static GSFS_Audio_Chunk *gsfs_lru_head = NULL;
+static GSFS_Audio_Chunk *gsfs_lru_tail = NULL;
+static int gsfs_lru_length = 0;
+
+static void gsfs_lru_unlink(GSFS_Audio_Chunk *chunk)
+{
+	if(chunk->lru_prev != NULL)
+		chunk->lru_prev->lru_next = chunk->lru_next;
+	else
+		gsfs_lru_head = chunk->lru_next;
+	if(chunk->lru_next != NULL)
+		chunk->lru_next->lru_prev = chunk->lru_prev;
+	else
+		gsfs_lru_tail = chunk->lru_prev;
+	chunk->lru_prev = chunk->lru_next = NULL;
+	gsfs_lru_length--;
+}
+
+static void gsfs_lru_push(GSFS_Audio_Chunk *chunk)
+{
+	chunk->lru_prev = NULL;
+	chunk->lru_next = gsfs_lru_head;
+	if(gsfs_lru_head != NULL)
+		gsfs_lru_head->lru_prev = chunk;
+	else
+		gsfs_lru_tail = chunk;
+	gsfs_lru_head = chunk;
+	gsfs_lru_length++;
+}
+
+// A chunk was just used; move it to the front of the list
+static void gsfs_lru_touch(GSFS_Audio *audio, GSFS_Audio_Chunk *chunk)
+{
+	gsfs_lru_unlink(chunk);
+	gsfs_lru_push(chunk);
+	chunk->chances = audio->songs - 1;
+}
+
+static void gsfs_chunk_evict(GSFS_Audio_Chunk *chunk)
+{
+	gsfs_lru_unlink(chunk);
+	gsfs_audio_bytes -= chunk->len;
+	free(chunk->data);
+	chunk->data = NULL;
+	chunk->len = 0;
+	chunk->state = CHUNK_EMPTY;
+}
+
+// Evict cold chunks until no more than target bytes are cached (or
+// everything left is pinned). Called with gsfs_audio_lock held.
+static void gsfs_audio_evict_to(size_t target)
+{
+	// each chunk can be looked at a bounded number of times, so we
+	// can't loop forever when everything is pinned
+	int steps = 2 * gsfs_lru_length;
+	GSFS_Audio_Chunk *chunk = gsfs_lru_tail;
+	
+	while(gsfs_audio_bytes > target && chunk != NULL && steps-- > 0)
+	{
+		GSFS_Audio_Chunk *prev = chunk->lru_prev;
+		
+		if(chunk->pins > 0)
+			;
+		else if(chunk->chances > 0)
+		{
+			// shared audio gets another lap
+			chunk->chances--;
+			gsfs_lru_unlink(chunk);
+			gsfs_lru_push(chunk);
+		}
+		else
+			gsfs_chunk_evict(chunk);
+		
+		chunk = prev != NULL ? prev : gsfs_lru_tail;
+	}
+	
+	// then transcoded variants nobody has open (see gsfs_transcode.c)
+	if(gsfs_audio_bytes > target)
+		gsfs_audio_bytes -= gsfs_variants_evict(gsfs_audio_bytes - target);
+}
+
+// Admission control. A fetch counts against gsfs_audio_budget from the
+// moment it starts, not just once its chunk is cached, so memory is
+// committed before it's allocated. When a fetch won't fit we first evict
+// cold chunks, and if that isn't enough, what happens depends on why the
+// chunk is wanted:
+//
+//   reads wait for fetches already in flight to land so their chunks can
+//   be evicted, and are let through over budget if there's nothing left
+//   to wait for; a read only fails if the allocator itself says no
+//   readahead is skipped, since the next read asks for it again
+//   prefetches are turned away too; the prefetch job queues itself to
+//   try again a little later, for up to GSFS_ADMIT_PATIENCE_MS, without
+//   holding a worker in the meantime
+//
+// gsfs_readahead_window() also narrows readahead as memory that can't be
+// evicted (pinned chunks and fetches in flight) fills up the budget.
+#define GSFS_ADMIT_PATIENCE_MS 5000
+#define GSFS_ADMIT_RETRY_MS 250
+
+static size_t gsfs_fetch_in_flight = 0;
+static size_t gsfs_pinned_bytes = 0;
+static int    gsfs_admit_waiters = 0;
+
+// How often admission had to step in, for the log
+static int gsfs_admit_waits = 0;
+static int gsfs_admit_shed = 0;
+static int gsfs_admit_overcommits = 0;
+
+static void gsfs_chunk_pin(GSFS_Audio_Chunk *chunk)
+{
+	if(chunk->pins++ == 0)
+		gsfs_pinned_bytes += chunk->len;
+}
+
+// Evict enough to fit size more bytes of fetching, if we can. Called with
+// gsfs_audio_lock held.
+static int gsfs_audio_make_room(size_t size)
+{
+	size_t committed = gsfs_fetch_in_flight + size;
+	gsfs_audio_evict_to(committed < gsfs_audio_budget ? gsfs_audio_budget - committed : 0);
+	return gsfs_audio_bytes + committed <= gsfs_audio_budget;
+}
+
+// Commit size bytes to a fetch at the given priority. Returns SUCCESS,
+// or EAGAIN if the fetch was turned away. Called with gsfs_audio_lock
+// held, which may be dropped while we wait.
+static int gsfs_audio_admit(size_t size, GSFS_Priority prio)
+{
+	int waited = 0;
+	int error = SUCCESS;
+	
+	while(!gsfs_audio_make_room(size))
+	{
+		// nobody is waiting on anything but a read
+		if(prio != GSFS_PRIO_READ)
+		{
+			error = EAGAIN;
+			break;
+		}
+		
+		if(gsfs_fetch_in_flight == 0)
+		{
+			// everything left is pinned by readers; better over budget
+			// for a moment than a failed read
+			gsfs_admit_overcommits++;
+			break;
+		}
+		
+		if(!waited)
+		{
+			waited = 1;
+			gsfs_admit_waits++;
+		}
+		
+		gsfs_admit_waiters++;
+		pthread_cond_wait(&gsfs_audio_cond, &gsfs_audio_lock);
+		gsfs_admit_waiters--;
+	}
+	
+	if(error == SUCCESS)
+		gsfs_fetch_in_flight += size;
+	else
+		gsfs_admit_shed++;
+	return error;
+}
+
+// How many chunks to read ahead right now: gsfs_readahead_chunks while
+// there's plenty of room, half that once half the budget can't be
+// evicted, and none past three quarters
+int gsfs_readahead_window(void)
+{
+	pthread_mutex_lock(&gsfs_audio_lock);
+	size_t unevictable = gsfs_pinned_bytes + gsfs_fetch_in_flight;
+	size_t budget = gsfs_audio_budget;
+	pthread_mutex_unlock(&gsfs_audio_lock);
+	
+	int window = atomic_load(&gsfs_readahead_chunks);
+	if(unevictable >= budget / 4 * 3)
+		return 0;
+	if(unevictable >= budget / 2)
+		return window / 2;
+	return window;
+}
+
+void gsfs_audio_log_admission(void)
+{
+	pthread_mutex_lock(&gsfs_audio_lock);
+	log_msg("    admission: %d fetches waited, %d turned away, %d let through over budget\n",
+		gsfs_admit_waits, gsfs_admit_shed, gsfs_admit_overcommits);
+	pthread_mutex_unlock(&gsfs_audio_lock);
+}
+
+// Account for audio cached outside of a song's own chunks; negative when
+// it's freed
+void gsfs_audio_charge(long bytes)
+{
+	pthread_mutex_lock(&gsfs_audio_lock);
+	gsfs_audio_bytes += bytes;
+	pthread_mutex_unlock(&gsfs_audio_lock);
+}
+
+// Attach a newly registered song to the cached audio for its recording,
+// creating the entry if this is the first song with it. The first song's
+// size becomes the recording's; from then on the song is as long as its
+// audio, whatever grooveshark said about it (see gsfs_song_size()).
+int gsfs_audio_acquire(Song *song)
+{
+	GSFS_Audio_Key key = gsfs_audio_key(song->audio_id, song->song_id);
+	int error = SUCCESS;
+	
+	pthread_mutex_lock(&gsfs_audio_lock);
+	
+	GSFS_Audio **slot = &(gsfs_audio_table[gsfs_audio_key_hash(key) % GSFS_AUDIO_BUCKETS]);
+	while(*slot != NULL && ((*slot)->key.kind != key.kind || (*slot)->key.id != key.id))
+		slot = &((*slot)->next);
+	
+	GSFS_Audio *audio = *slot;
+	if(audio == NULL)
+	{
+		audio = calloc(1, sizeof(GSFS_Audio));
+		if(audio != NULL)
+			audio->chunks = calloc(gsfs_num_chunks(song->size), sizeof(GSFS_Audio_Chunk));
+		if(audio == NULL || audio->chunks == NULL)
+		{
+			free(audio);
+			error = ENOMEM;
+		}
+		else
+		{
+			audio->key = key;
+			audio->song_id = song->song_id;
+			audio->size = song->size;
+			audio->tag_end = -1;
+			*slot = audio;
+			gsfs_unique_audio_bytes += audio->size;
+		}
+	}
+	
+	if(error == SUCCESS)
+	{
+		audio->songs++;
+		song->audio = audio;
+		gsfs_catalog_audio_bytes += song->size;
+		gsfs_catalog_songs++;
+	}
+	
+	pthread_mutex_unlock(&gsfs_audio_lock);
+	return error;
+}
+
+// A song is going away; free its audio if no other song shares it
+void gsfs_audio_release(Song *song)
+{
+	GSFS_Audio *audio = song->audio;
+	
+	pthread_mutex_lock(&gsfs_audio_lock);
+	
+	gsfs_catalog_audio_bytes -= song->size;
+	gsfs_catalog_songs--;
+	song->audio = NULL;
+	
+	if(--audio->songs == 0)
+	{
+		GSFS_Audio **slot = &(gsfs_audio_table[gsfs_audio_key_hash(audio->key) % GSFS_AUDIO_BUCKETS]);
+		while(*slot != audio)
+			slot = &((*slot)->next);
+		*slot = audio->next;
+		
+		int num_chunks = gsfs_num_chunks(audio->size);
+		for(int i = 0; i < num_chunks; i++)
+			if(audio->chunks[i].state == CHUNK_READY)
+				gsfs_chunk_evict(&(audio->chunks[i]));
+		
+		gsfs_unique_audio_bytes -= audio->size;
+		free(audio->mp3);
+		free(audio->chunks);
+		free(audio);
+	}
+	
+	pthread_mutex_unlock(&gsfs_audio_lock);
+}
+
+// Change the cache's budget on the fly, evicting down to it right away
+void gsfs_audio_set_budget(size_t budget)
+{
+	pthread_mutex_lock(&gsfs_audio_lock);
+	gsfs_audio_budget = budget;
+	gsfs_audio_evict_to(gsfs_fetch_in_flight < budget ? budget - gsfs_fetch_in_flight : 0);
+	// fetches waiting for room may fit now
+	pthread_cond_broadcast(&gsfs_audio_cond);
+	pthread_mutex_unlock(&gsfs_audio_lock);
+}
+
+// Evict every chunk that isn't being read from right now
+void gsfs_audio_drop_caches(void)
+{
+	pthread_mutex_lock(&gsfs_audio_lock);
+	gsfs_audio_evict_to(0);
+	pthread_cond_broadcast(&gsfs_audio_cond);
+	pthread_mutex_unlock(&gsfs_audio_lock);
+}
+
+// The cache's budget, how much of it is in use, and how many songs are
+// registered, all kept up to date as we go so statfs needn't walk anything
+void gsfs_audio_usage(size_t *budget, size_t *used, long *songs)
+{
+	pthread_mutex_lock(&gsfs_audio_lock);
+	*budget = gsfs_audio_budget;
+	*used = gsfs_audio_bytes;
+	*songs = gsfs_catalog_songs;
+	pthread_mutex_unlock(&gsfs_audio_lock);
+}
+
+// Report how much space sharing recordings between songs saves
+void gsfs_audio_log_sharing(void)
+{
+	pthread_mutex_lock(&gsfs_audio_lock);
+	log_msg("    audio: catalog lists %zu bytes, %zu unique, %.1f%% saved by sharing\n",
+		gsfs_catalog_audio_bytes, gsfs_unique_audio_bytes,
+		gsfs_catalog_audio_bytes == 0 ? 0.0
+			: 100.0 * (gsfs_catalog_audio_bytes - gsfs_unique_audio_bytes) / gsfs_catalog_audio_bytes);
+	pthread_mutex_unlock(&gsfs_audio_lock);
+}
+
+// Chunks fetched from grooveshark are also kept on disk, one file per
+// chunk, under gsfs_disk_cache_dir (the rootdir we were mounted over).
+// Writes go through the I/O engine in gsfs_io.c, so whoever fetched the
+// chunk needn't wait for the disk; reads are plain pread()s by whoever
+// wants the chunk, since they'd have to wait for it anyway.
+//
+// The disk cache has a budget of its own, gsfs_disk_cache_budget bytes.
+// A chunk's mtime is bumped whenever it's read back, so the oldest mtime
+// is the least recently used chunk; when the cache goes over budget, a
+// background job evicts chunks oldest first until it's a tenth under.
+// The job also recounts what's on disk, so the running total can't drift
+// far from the truth.
+char *gsfs_disk_cache_dir = NULL;
+
+static pthread_mutex_t gsfs_disk_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t gsfs_disk_cache_budget = (size_t) 4 * 1024 * 1024 * 1024;
+static size_t gsfs_disk_cache_bytes = 0;
+static int    gsfs_disk_cache_evicting = 0;
+static long   gsfs_disk_cache_evicted = 0;
+
+typedef struct {
+	char   name[NAME_MAX + 1];
+	time_t mtime;
+	size_t size;
+} GSFS_Disk_Cache_File;
+
+// Chunk files are named [s]<id>.<index>; anything else in the directory
+// (the access log, half written .tmp files, whatever else was there
+// before we were mounted) is left alone
+static int gsfs_disk_cache_is_chunk(const char *name)
+{
+	if(*name == 's')
+		name++;
+	if(!isdigit((unsigned char) *name))
+		return 0;
+	while(isdigit((unsigned char) *name))
+		name++;
+	if(*name++ != '.' || !isdigit((unsigned char) *name))
+		return 0;
+	while(isdigit((unsigned char) *name))
+		name++;
+	return *name == '\0';
+}
+
+static int gsfs_disk_cache_file_compare(const void *a, const void *b)
+{
+	time_t x = ((GSFS_Disk_Cache_File *) a)->mtime;
+	time_t y = ((GSFS_Disk_Cache_File *) b)->mtime;
+	return x < y ? -1 : x > y;
+}
+
+// Count what's in the disk cache, and evict the least recently used
+// chunks if that's over budget
+static void gsfs_disk_cache_evict_job(void *arg, int cancelled)
+{
+	GSFS_PROFILE_SCOPE(__func__);
+	GSFS_Disk_Cache_File *files = NULL;
+	size_t num_files = 0, capacity = 0;
+	size_t total = 0;
+	
+	DIR *dir = cancelled ? NULL : opendir(gsfs_disk_cache_dir);
+	struct dirent *entry;
+	while(dir != NULL && (entry = readdir(dir)) != NULL)
+	{
+		struct stat st;
+		if(!gsfs_disk_cache_is_chunk(entry->d_name)
+			|| fstatat(dirfd(dir), entry->d_name, &st, 0) != 0)
+			continue;
+		
+		if(num_files == capacity)
+		{
+			size_t grown = capacity > 0 ? 2 * capacity : 1024;
+			GSFS_Disk_Cache_File *more = realloc(files, grown * sizeof(GSFS_Disk_Cache_File));
+			if(more == NULL)
+				break;
+			files = more;
+			capacity = grown;
+		}
+		strcpy(files[num_files].name, entry->d_name);
+		files[num_files].mtime = st.st_mtime;
+		files[num_files].size = st.st_size;
+		num_files++;
+		total += st.st_size;
+	}
+	
+	pthread_mutex_lock(&gsfs_disk_cache_lock);
+	size_t target = gsfs_disk_cache_budget / 10 * 9;
+	pthread_mutex_unlock(&gsfs_disk_cache_lock);
+	
+	long evicted = 0;
+	if(dir != NULL && total > target)
+	{
+		qsort(files, num_files, sizeof(GSFS_Disk_Cache_File), gsfs_disk_cache_file_compare);
+		for(size_t i = 0; i < num_files && total > target; i++)
+		{
+			if(unlinkat(dirfd(dir), files[i].name, 0) != 0)
+				continue;
+			total -= files[i].size;
+			evicted++;
+		}
+	}
+	if(dir != NULL)
+		closedir(dir);
+	free(files);
+	
+	pthread_mutex_lock(&gsfs_disk_cache_lock);
+	if(!cancelled)
+		gsfs_disk_cache_bytes = total;
+	gsfs_disk_cache_evicted += evicted;
+	gsfs_disk_cache_evicting = 0;
+	pthread_mutex_unlock(&gsfs_disk_cache_lock);
+}
+
+// Claim the eviction job, unless it's running already; the caller starts
+// it with gsfs_disk_cache_evict() once it has let go of the lock. Called
+// with gsfs_disk_cache_lock held.
+static int gsfs_disk_cache_claim_eviction(void)
+{
+	if(gsfs_disk_cache_evicting || gsfs_disk_cache_dir == NULL)
+		return 0;
+	gsfs_disk_cache_evicting = 1;
+	return 1;
+}
+
+static void gsfs_disk_cache_evict(void)
+{
+	gsfs_sched_submit(GSFS_PRIO_PREFETCH, NULL, gsfs_disk_cache_evict_job, NULL);
+}
+
+// Find out how much the disk cache holds from earlier runs, trimming it
+// to budget if need be
+void gsfs_disk_cache_init(void)
+{
+	pthread_mutex_lock(&gsfs_disk_cache_lock);
+	int evict = gsfs_disk_cache_claim_eviction();
+	pthread_mutex_unlock(&gsfs_disk_cache_lock);
+	if(evict)
+		gsfs_disk_cache_evict();
+}
+
+void gsfs_disk_cache_set_budget(size_t budget)
+{
+	pthread_mutex_lock(&gsfs_disk_cache_lock);
+	gsfs_disk_cache_budget = budget;
+	int evict = gsfs_disk_cache_bytes > budget && gsfs_disk_cache_claim_eviction();
+	pthread_mutex_unlock(&gsfs_disk_cache_lock);
+	if(evict)
+		gsfs_disk_cache_evict();
+}
+
+// The disk cache's budget and how much of it is in use, as far as we know
+void gsfs_disk_cache_usage(size_t *budget, size_t *used)
+{
+	pthread_mutex_lock(&gsfs_disk_cache_lock);
+	*budget = gsfs_disk_cache_budget;
+	*used = gsfs_disk_cache_bytes;
+	pthread_mutex_unlock(&gsfs_disk_cache_lock);
+}
+
+void gsfs_disk_cache_log(void)
+{
+	pthread_mutex_lock(&gsfs_disk_cache_lock);
+	log_msg("    disk cache: %zu of %zu bytes in use, %ld chunks evicted\n",
+		gsfs_disk_cache_bytes, gsfs_disk_cache_budget, gsfs_disk_cache_evicted);
+	pthread_mutex_unlock(&gsfs_disk_cache_lock);
+}
+
+// Recordings' chunks are named after their audio id, and songs without
+// one after their song id, with an "s" in front so the two can't collide
+static void gsfs_disk_cache_path(char path[PATH_MAX], GSFS_Audio_Key key, int index)
+{
+	snprintf(path, PATH_MAX, "%s/%s%ld.%d", gsfs_disk_cache_dir,
+		key.kind == AUDIO_KEY_SONG ? "s" : "", key.id, index);
+}
+
+// Read a chunk back from the disk cache; ENOENT if it isn't there
+static int gsfs_disk_cache_read(
+	GSFS_Audio_Key key,
+	int index,
+	char *data,
+	size_t size,
+	size_t *len)
+{
+	char path[PATH_MAX];
+	
+	if(gsfs_disk_cache_dir == NULL)
+		return ENOENT;
+	
+	gsfs_disk_cache_path(path, key, index);
+	int fd = open(path, O_RDONLY);
+	if(fd < 0)
+		return ENOENT;
+	
+	ssize_t result = pread(fd, data, size, 0);
+	// used just now, as far as eviction is concerned
+	if(result >= 0)
+		futimens(fd, NULL);
+	close(fd);
+	
+	// short of the whole chunk (or failed altogether); fetch it again
+	if(result < 0 || (size_t) result < size)
+		return ENOENT;
+	
+	*len = result;
+	return SUCCESS;
+}
+
+typedef struct {
+	int   fd;
+	char *data;
+	size_t len;
+	ssize_t result;
+	char  tmp_path[PATH_MAX];
+	char  path[PATH_MAX];
+} GSFS_Disk_Cache_Write;
+
+// The chunk is only renamed into place once it's completely written, so
+// a crash never leaves a truncated chunk behind. Always does its work,
+// cancelled or not: the file has to be closed either way.
+static void gsfs_disk_cache_finish_job(void *arg, int cancelled)
+{
+	GSFS_Disk_Cache_Write *pending = arg;
+	ssize_t result = pending->result;
+	
+	close(pending->fd);
+	if(result >= 0 && (size_t) result == pending->len
+		&& rename(pending->tmp_path, pending->path) == 0)
+	{
+		pthread_mutex_lock(&gsfs_disk_cache_lock);
+		gsfs_disk_cache_bytes += pending->len;
+		int evict = gsfs_disk_cache_bytes > gsfs_disk_cache_budget
+			&& gsfs_disk_cache_claim_eviction();
+		pthread_mutex_unlock(&gsfs_disk_cache_lock);
+		if(evict)
+			gsfs_disk_cache_evict();
+	}
+	else
+		unlink(pending->tmp_path);
+	
+	free(pending->data);
+	free(pending);
+}
+
+// Called on the I/O engine's completion thread, which every other
+// request's completion waits behind, so the closing and renaming is
+// left to a job
+static void gsfs_disk_cache_written(void *arg, ssize_t result)
+{
+	GSFS_Disk_Cache_Write *pending = arg;
+	pending->result = result;
+	gsfs_sched_submit(GSFS_PRIO_PREFETCH, NULL, gsfs_disk_cache_finish_job, pending);
+}
+
+// Write a freshly fetched chunk to the disk cache in the background
+static void gsfs_disk_cache_write(
+	GSFS_Audio_Key key,
+	int index,
+	char *data,
+	size_t len)
+{
+	if(gsfs_disk_cache_dir == NULL)
+		return;
+	
+	GSFS_Disk_Cache_Write *pending = calloc(1, sizeof(GSFS_Disk_Cache_Write));
+	if(pending == NULL)
+		return;
+	
+	// copy the audio, since the chunk it came from may be evicted
+	pending->data = malloc(len);
+	if(pending->data == NULL)
+	{
+		free(pending);
+		return;
+	}
+	memcpy(pending->data, data, len);
+	pending->len = len;
+	
+	gsfs_disk_cache_path(pending->path, key, index);
+	snprintf(pending->tmp_path, PATH_MAX, "%s.tmp", pending->path);
+	
+	pending->fd = open(pending->tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if(pending->fd < 0
+		|| gsfs_io_submit(GSFS_IO_WRITE, pending->fd, pending->data, len, 0,
+			gsfs_disk_cache_written, pending) != SUCCESS)
+	{
+		if(pending->fd >= 0)
+		{
+			close(pending->fd);
+			unlink(pending->tmp_path);
+		}
+		free(pending->data);
+		free(pending);
+	}
+}
+
+// Fetch a chunk's audio from grooveshark. A body that comes back short of
+// size may have been cut off by a dropped connection, and caching it
+// would leave a hole in the song for good, so it's asked for once more;
+// if it's just as short again, that's all there is.
+static int gsfs_fetch_chunk(long song_id, off_t offset, size_t size, char *data, size_t *len)
+{
+	int error = SUCCESS;
+	for(int attempt = 0; attempt < 2; attempt++)
+	{
+		error = gsfs_fault_request();
+		if(error == SUCCESS)
+		{
+			GSFS_PROFILE_SCOPE("gsfs_fetch_audio");
+			error = gsfs_fetch_audio(song_id, offset, size, data, len);
+		}
+		if(error != SUCCESS)
+			return error;
+		gsfs_fault_body(len);
+		if(*len == size)
+			break;
+	}
+	return error;
+}
+
+// Fetch a chunk straight into the disk cache, with no song to hang it
+// off; used to warm the cache up after a restart, before anything is
+// registered. Does nothing if the chunk is on disk already. audio_id is
+// 0 if grooveshark gave the song none.
+int gsfs_disk_cache_preload(long audio_id, long song_id, int index)
+{
+	char path[PATH_MAX];
+	GSFS_Audio_Key key = gsfs_audio_key(audio_id, song_id);
+	
+	if(gsfs_disk_cache_dir == NULL)
+		return ENOENT;
+	
+	gsfs_disk_cache_path(path, key, index);
+	if(access(path, F_OK) == 0)
+		return SUCCESS;
+	
+	char *data = gsfs_fault_malloc(GSFS_CHUNK_SIZE);
+	if(data == NULL)
+		return ENOMEM;
+	
+	// the last chunk of a song just comes back short
+	size_t len = 0;
+	int error = gsfs_fetch_chunk(song_id, (off_t) index * GSFS_CHUNK_SIZE,
+		GSFS_CHUNK_SIZE, data, &len);
+	if(error == SUCCESS && len > 0)
+		gsfs_disk_cache_write(key, index, data, len);
+	
+	free(data);
+	return error;
+}
+
+// Where chunks asked for were found: already in memory, in the disk
+// cache, or nowhere, so they had to come from grooveshark. Guarded by
+// gsfs_audio_lock.
+static long gsfs_memory_hits = 0;
+static long gsfs_disk_hits = 0;
+static long gsfs_misses = 0;
+
+static void gsfs_audio_count(long *counter)
+{
+	pthread_mutex_lock(&gsfs_audio_lock);
+	(*counter)++;
+	pthread_mutex_unlock(&gsfs_audio_lock);
+}
+
+void gsfs_audio_log_hits(void)
+{
+	pthread_mutex_lock(&gsfs_audio_lock);
+	long total = gsfs_memory_hits + gsfs_disk_hits + gsfs_misses;
+	log_msg("    chunks: %ld from memory, %ld from disk, %ld fetched (%.1f%% hit ratio)\n",
+		gsfs_memory_hits, gsfs_disk_hits, gsfs_misses,
+		total == 0 ? 0.0 : 100.0 * (gsfs_memory_hits + gsfs_disk_hits) / total);
+	pthread_mutex_unlock(&gsfs_audio_lock);
+}
+
+// Whether a chunk just got should be looked at for what the song's first
+// frame says: the first chunk always is, to find where the audio starts,
+// then the chunk that frame is in. Call with gsfs_audio_lock held.
+static int gsfs_audio_wants_mp3(GSFS_Audio *audio, int index)
+{
+	if(audio->mp3_tried)
+		return 0;
+	if(index == 0)
+		return 1;
+	return audio->tag_end >= 0 && audio->tag_end / GSFS_CHUNK_SIZE == index;
+}
+
+// Look at a pinned chunk the song's first frame may be in. An ID3 tag
+// longer than a chunk pushes the frame into a later one; it's looked at
+// when that chunk is got, which reading the song gets to soon enough.
+static void gsfs_audio_learn_mp3(GSFS_Audio *audio, int index, GSFS_Audio_Chunk *chunk)
+{
+	const unsigned char *data = (const unsigned char *) chunk->data;
+	off_t offset = (off_t) index * GSFS_CHUNK_SIZE;
+	off_t tag_end;
+	
+	if(index == 0)
+		tag_end = gsfs_id3v2_length(data, chunk->len);
+	else
+	{
+		pthread_mutex_lock(&gsfs_audio_lock);
+		tag_end = audio->tag_end;
+		pthread_mutex_unlock(&gsfs_audio_lock);
+	}
+	
+	int here = tag_end >= offset && tag_end < offset + (off_t) chunk->len;
+	GSFS_MP3_Info *mp3 = NULL;
+	if(here)
+		mp3 = gsfs_mp3_info_build(data, chunk->len, offset, tag_end, audio->size);
+	
+	pthread_mutex_lock(&gsfs_audio_lock);
+	audio->tag_end = tag_end;
+	// a tag running past the end of the song leaves nothing to look at
+	if(here || tag_end >= (off_t) audio->size)
+		audio->mp3_tried = 1;
+	if(mp3 != NULL && audio->mp3 == NULL)
+	{
+		audio->mp3 = mp3;
+		mp3 = NULL;
+	}
+	pthread_mutex_unlock(&gsfs_audio_lock);
+	free(mp3);
+}
+
+// Get a chunk of a song's audio, reading it from the disk cache or
+// fetching it from grooveshark if it isn't in memory yet. If another
+// thread is already fetching the chunk, wait for it rather than fetching
+// it twice.
+// On success the chunk is pinned, so it can't be evicted while the caller
+// copies out of it; give it back with gsfs_put_song_audio().
+// A fetch has to be admitted first (see gsfs_audio_admit()), so
+// readahead and prefetches may get EAGAIN when memory is tight.
+int gsfs_get_song_audio(
+	Song *song,
+	int index,
+	GSFS_Priority prio,
+	GSFS_Audio_Chunk **chunk_out)
+{
+	GSFS_PROFILE_SCOPE(__func__);
+	GSFS_Audio *audio = song->audio;
+	GSFS_Audio_Chunk *chunk = &(audio->chunks[index]);
+	
+	off_t  offset = (off_t) index * GSFS_CHUNK_SIZE;
+	size_t size = audio->size - offset;
+	if(size > GSFS_CHUNK_SIZE)
+		size = GSFS_CHUNK_SIZE;
+	
+	*chunk_out = chunk;
+	
+	pthread_mutex_lock(&gsfs_audio_lock);
+	
+	// somebody else is fetching this chunk; wait for them
+	while(chunk->state == CHUNK_FETCHING)
+		pthread_cond_wait(&gsfs_audio_cond, &gsfs_audio_lock);
+	
+	if(chunk->state == CHUNK_READY)
+	{
+		gsfs_chunk_pin(chunk);
+		gsfs_lru_touch(audio, chunk);
+		gsfs_memory_hits++;
+		int learn = gsfs_audio_wants_mp3(audio, index);
+		pthread_mutex_unlock(&gsfs_audio_lock);
+		if(learn)
+			gsfs_audio_learn_mp3(audio, index, chunk);
+		return SUCCESS;
+	}
+	
+	// the chunk is ours to fetch, if there's room for it
+	chunk->state = CHUNK_FETCHING;
+	int error = gsfs_audio_admit(size, prio);
+	if(error != SUCCESS)
+	{
+		chunk->state = CHUNK_EMPTY;
+		pthread_cond_broadcast(&gsfs_audio_cond);
+		pthread_mutex_unlock(&gsfs_audio_lock);
+		return error;
+	}
+	pthread_mutex_unlock(&gsfs_audio_lock);
+	
+	size_t len = 0;
+	char *data = gsfs_fault_malloc(size);
+	if(data == NULL)
+	{
+		// the system ran short before our budget did; give back half of
+		// what we have cached and try once more
+		pthread_mutex_lock(&gsfs_audio_lock);
+		gsfs_audio_evict_to(gsfs_audio_bytes / 2);
+		pthread_mutex_unlock(&gsfs_audio_lock);
+		data = malloc(size);
+	}
+	
+	if(data == NULL)
+		error = ENOMEM;
+	else if(gsfs_disk_cache_read(audio->key, index, data, size, &len) == SUCCESS)
+		gsfs_audio_count(&gsfs_disk_hits);
+	else
+	{
+		gsfs_audio_count(&gsfs_misses);
+		// what reads fetch counts against the bandwidth limit too;
+		// readahead was charged when the shaper dispatched it. Only
+		// whoever moved the chunk on from empty gets this far, so a
+		// chunk is charged once however many readers wanted it.
+		if(prio == GSFS_PRIO_READ)
+			gsfs_shaper_charge(size);
+		error = gsfs_fetch_chunk(audio->song_id, offset, size, data, &len);
+		// a short chunk may be all the audio grooveshark has, but it
+		// isn't kept on disk, so a later run asks again
+		if(error == SUCCESS && len == size)
+			gsfs_disk_cache_write(audio->key, index, data, len);
+	}
+	
+	int learn = 0;
+	pthread_mutex_lock(&gsfs_audio_lock);
+	gsfs_fetch_in_flight -= size;
+	if(error == SUCCESS)
+	{
+		chunk->data = data;
+		chunk->len = len;
+		chunk->state = CHUNK_READY;
+		gsfs_chunk_pin(chunk);
+		chunk->chances = audio->songs - 1;
+		gsfs_lru_push(chunk);
+		gsfs_audio_bytes += len;
+		gsfs_audio_evict_to(gsfs_fetch_in_flight < gsfs_audio_budget
+			? gsfs_audio_budget - gsfs_fetch_in_flight : 0);
+		learn = gsfs_audio_wants_mp3(audio, index);
+	}
+	else
+	{
+		// let the next reader retry
+		free(data);
+		chunk->state = CHUNK_EMPTY;
+	}
+	pthread_cond_broadcast(&gsfs_audio_cond);
+	pthread_mutex_unlock(&gsfs_audio_lock);
+	
+	if(learn)
+		gsfs_audio_learn_mp3(audio, index, chunk);
+	return error;
+}
+
+// Unpin a chunk returned by gsfs_get_song_audio()
+void gsfs_put_song_audio(GSFS_Audio_Chunk *chunk)
+{
+	pthread_mutex_lock(&gsfs_audio_lock);
+	if(--chunk->pins == 0)
+	{
+		gsfs_pinned_bytes -= chunk->len;
+		// the chunk can be evicted now, which may make room for a fetch
+		if(gsfs_admit_waiters > 0)
+			pthread_cond_broadcast(&gsfs_audio_cond);
+	}
+	pthread_mutex_unlock(&gsfs_audio_lock);
+}
+
+// Is the chunk in memory right now? By the time the caller looks, it
+// may not be any more.
+int gsfs_song_chunk_ready(Song *song, int index)
+{
+	pthread_mutex_lock(&gsfs_audio_lock);
+	int ready = song->audio->chunks[index].state == CHUNK_READY;
+	pthread_mutex_unlock(&gsfs_audio_lock);
+	return ready;
+}
+
+// What the song's first MP3 frame (see gsfs_mp3.c) says about it. None of
+// it is known until the chunk that frame is in has been got, but from then
+// on it's answered without touching the audio.
+long gsfs_song_duration_ms(Song *song)
+{
+	GSFS_Audio *audio = song->audio;
+	long duration = -1;
+	pthread_mutex_lock(&gsfs_audio_lock);
+	if(audio->mp3 != NULL)
+		duration = audio->mp3->duration_ms;
+	pthread_mutex_unlock(&gsfs_audio_lock);
+	return duration;
+}
+
+int gsfs_song_bitrate(Song *song)
+{
+	GSFS_Audio *audio = song->audio;
+	int bitrate = 0;
+	pthread_mutex_lock(&gsfs_audio_lock);
+	if(audio->mp3 != NULL)
+		bitrate = audio->mp3->bitrate;
+	pthread_mutex_unlock(&gsfs_audio_lock);
+	return bitrate;
+}
+
+// Chunks can also be fetched asynchronously: the fetch runs as a job on
+// the scheduler (gsfs_sched.c) at the given priority and the callback is
+// invoked with its result, so a caller needing several chunks can start
+// them all at once and wait for them together.
+typedef void (*gsfs_audio_callback)(void *arg, int error);
+
+typedef struct {
+	Song *song;
+	int   index;
+	GSFS_Priority prio;
+	gsfs_audio_callback callback;
+	void *arg;
+} GSFS_Fetch_Job;
+
+static void gsfs_fetch_job(void *arg, int cancelled)
+{
+	GSFS_PROFILE_SCOPE(__func__);
+	GSFS_Fetch_Job *job = arg;
+	GSFS_Audio_Chunk *chunk;
+	int error = ECANCELED;
+	
+	if(!cancelled)
+		error = gsfs_get_song_audio(job->song, job->index, job->prio, &chunk);
+	if(error == SUCCESS)
+		gsfs_put_song_audio(chunk);
+	if(job->callback != NULL)
+		job->callback(job->arg, error);
+	
+	gsfs_artist_unref(job->song->album->artist);
+	free(job);
+}
+
+// Fetch a chunk in the background and call callback (if there is one)
+// when it's ready. Chunks already in memory complete immediately, on the
+// caller's thread; chunks somebody else is fetching aren't fetched twice
+// for a caller that doesn't want to hear back.
+void gsfs_get_song_audio_async(
+	Song *song,
+	int index,
+	GSFS_Priority prio,
+	GSFS_Job_Group *group,
+	gsfs_audio_callback callback,
+	void *arg)
+{
+	GSFS_Chunk_State state;
+	
+	pthread_mutex_lock(&gsfs_audio_lock);
+	state = song->audio->chunks[index].state;
+	pthread_mutex_unlock(&gsfs_audio_lock);
+	
+	if(state == CHUNK_READY || (state == CHUNK_FETCHING && callback == NULL))
+	{
+		if(callback != NULL)
+			callback(arg, SUCCESS);
+		return;
+	}
+	
+	GSFS_Fetch_Job *job = gsfs_fault_calloc(1, sizeof(GSFS_Fetch_Job));
+	if(job == NULL)
+	{
+		if(callback != NULL)
+			callback(arg, ENOMEM);
+		return;
+	}
+	job->song = song;
+	job->index = index;
+	job->prio = prio;
+	job->callback = callback;
+	job->arg = arg;
+	
+	// the song mustn't be deregistered out from under the job
+	gsfs_artist_ref(song->album->artist);
+	gsfs_sched_submit(prio, group, gsfs_fetch_job, job);
+}
+
+// Readahead: keep the next gsfs_readahead_chunks chunks past whatever a
+// stream last read on their way in
+atomic_int gsfs_readahead_chunks = 2;
+
+// Prefetch policy: once a song has been read sequentially past
+// gsfs_prefetch_threshold bytes, fetch the first gsfs_prefetch_chunks
+// chunks of the next gsfs_prefetch_tracks songs on the album, so the
+// next track doesn't start with a cold read.
+// A prefetch job walks those chunks and hands each to a job of its own,
+// at gsfs_prefetch_rate bytes per second. Chunks handed out and not yet
+// fetched, whichever stream they're for, never add up to more than
+// gsfs_prefetch_budget bytes; past that the walk waits for some to land.
+// These, like the other tuning knobs, can be changed while we're running
+// (see /.gsfs in gsfs.c), so they're atomic.
+atomic_size_t gsfs_prefetch_threshold = 512 * 1024;
+atomic_int    gsfs_prefetch_tracks = 2;
+atomic_int    gsfs_prefetch_chunks = 2;
+atomic_size_t gsfs_prefetch_budget = 4 * GSFS_CHUNK_SIZE;
+atomic_size_t gsfs_prefetch_rate = 1024 * 1024;
+
+static size_t gsfs_prefetch_in_flight = 0;
+
+// Reserve room for a prefetched chunk; returns 0 if we're over budget
+static int gsfs_prefetch_reserve(size_t size)
+{
+	int ok;
+	pthread_mutex_lock(&gsfs_audio_lock);
+	ok = gsfs_prefetch_in_flight + size <= atomic_load(&gsfs_prefetch_budget);
+	if(ok)
+		gsfs_prefetch_in_flight += size;
+	pthread_mutex_unlock(&gsfs_audio_lock);
+	return ok;
+}
+
+static void gsfs_prefetch_unreserve(size_t size)
+{
+	pthread_mutex_lock(&gsfs_audio_lock);
+	gsfs_prefetch_in_flight -= size;
+	pthread_mutex_unlock(&gsfs_audio_lock);
+}
+
+typedef struct {
+	Song *song;
+	GSFS_Job_Group *group;
+	int track;     // how far past song the next chunk is
+	int chunk;
+} GSFS_Prefetch_Job;
+
+// One chunk handed out by a prefetch job, holding its reservation
+typedef struct {
+	Song *song;    // the song the chunk belongs to
+	GSFS_Job_Group *group;
+	int index;
+	size_t size;
+	long waited_ms; // for room in the cache
+} GSFS_Prefetch_Chunk;
+
+static void gsfs_prefetch_chunk_job(void *arg, int cancelled)
+{
+	GSFS_Prefetch_Chunk *job = arg;
+	GSFS_Audio_Chunk *chunk;
+	int error = ECANCELED;
+	
+	if(!cancelled)
+		error = gsfs_get_song_audio(job->song, job->index, GSFS_PRIO_PREFETCH, &chunk);
+	if(error == SUCCESS)
+		gsfs_put_song_audio(chunk);
+	else if(error == EAGAIN && job->waited_ms < GSFS_ADMIT_PATIENCE_MS)
+	{
+		// no room in the cache just now; try again, still reserved
+		job->waited_ms += GSFS_ADMIT_RETRY_MS;
+		gsfs_sched_submit_after(GSFS_PRIO_PREFETCH, job->group,
+			gsfs_prefetch_chunk_job, job, GSFS_ADMIT_RETRY_MS);
+		return;
+	}
+	
+	gsfs_prefetch_unreserve(job->size);
+	gsfs_artist_unref(job->song->album->artist);
+	free(job);
+}
+
+// Hand out the next chunk, then queue the job again for the one after,
+// delayed long enough to stay under gsfs_prefetch_rate, so the wait
+// isn't spent holding a worker. Over budget, it queues itself to look
+// again once some of what's in flight may have landed.
+static void gsfs_prefetch_job(void *arg, int cancelled)
+{
+	GSFS_Prefetch_Job *job = arg;
+	Song *song = job->song;
+	Album *album = song->album;
+	
+	// done with this song's chunks; move on to the next song's
+	while(song->track_index + job->track < album->num_songs
+		&& (job->chunk >= gsfs_prefetch_chunks
+			|| job->chunk >= gsfs_song_num_chunks(&(album->songs[song->track_index + job->track]))))
+	{
+		job->track++;
+		job->chunk = 0;
+	}
+	
+	long delay_ms = 0;
+	int more = !cancelled && job->track <= gsfs_prefetch_tracks
+		&& song->track_index + job->track < album->num_songs;
+	if(more)
+	{
+		Song *next = &(album->songs[song->track_index + job->track]);
+		size_t size = gsfs_song_size(next) - (off_t) job->chunk * GSFS_CHUNK_SIZE;
+		if(size > GSFS_CHUNK_SIZE)
+			size = GSFS_CHUNK_SIZE;
+		
+		GSFS_Prefetch_Chunk *fetch = NULL;
+		if(!gsfs_prefetch_reserve(size))
+			delay_ms = GSFS_ADMIT_RETRY_MS;
+		else if((fetch = gsfs_fault_calloc(1, sizeof(GSFS_Prefetch_Chunk))) == NULL)
+		{
+			gsfs_prefetch_unreserve(size);
+			more = 0;
+		}
+		else
+		{
+			fetch->song = next;
+			fetch->group = job->group;
+			fetch->index = job->chunk;
+			fetch->size = size;
+			// each chunk holds the album's artist for itself
+			gsfs_artist_ref(album->artist);
+			gsfs_sched_submit(GSFS_PRIO_PREFETCH, job->group, gsfs_prefetch_chunk_job, fetch);
+			job->chunk++;
+			
+			// stay under the prefetch bandwidth limit
+			size_t rate = atomic_load(&gsfs_prefetch_rate);
+			if(rate > 0)
+				delay_ms = (long) ((double) size * 1000 / rate);
+		}
+	}
+	
+	if(more)
+	{
+		// the stream that asked for this may since have been closed, in
+		// which case the job runs cancelled and stops here
+		gsfs_sched_submit_after(GSFS_PRIO_PREFETCH, job->group, gsfs_prefetch_job, job, delay_ms);
+		return;
+	}
+	
+	gsfs_artist_unref(album->artist);
+	free(job);
+}
+
+// Start prefetching the songs following this one in the background, on
+// behalf of the stream whose jobs are in group
+void gsfs_prefetch_next_songs(Song *song, GSFS_Job_Group *group)
+{
+	if(song->album == NULL || gsfs_prefetch_tracks <= 0)
+		return;
+	
+	GSFS_Prefetch_Job *job = calloc(1, sizeof(GSFS_Prefetch_Job));
+	if(job == NULL)
+		return;
+	job->song = song;
+	job->group = group;
+	job->track = 1;
+	
+	gsfs_artist_ref(song->album->artist);
+	gsfs_sched_submit(GSFS_PRIO_PREFETCH, group, gsfs_prefetch_job, job);
+}
@@ -0,0 +1,153 @@
+/*
+  Fault injection.
+
+  Built with GSFS_FAULT_INJECTION, every call to the grooveshark client
+  and the allocations the read and registration paths can't do without
+  pass through here first, and fail now and then on purpose, so that the
+  error handling behind them gets exercised against a real mount. Which
+  faults, and how often, comes from the GSFS_FAULTS environment variable,
+  a comma separated list of name=probability pairs:
+
+    latency=0.05,latency_ms=2000   stall a request for latency_ms
+    drop=0.01                      fail a request with ERROR_CONNECTION_LOST
+    truncate=0.01                  cut a body of audio short
+    nomem=0.001                    fail an allocation
+
+  Built without it, none of these ever fire and the calls cost nothing
+  worth measuring.
+
+  gcc -DGSFS_FAULT_INJECTION ...
+*/
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef enum {
+	FAULT_LATENCY,
+	FAULT_DROP,
+	FAULT_TRUNCATE,
+	FAULT_NOMEM,
+	GSFS_NUM_FAULTS
+} GSFS_Fault;
+
+#ifdef GSFS_FAULT_INJECTION
+
+static const char *gsfs_fault_names[GSFS_NUM_FAULTS] = {
+	"latency", "drop", "truncate", "nomem"
+};
+
+static double gsfs_fault_rates[GSFS_NUM_FAULTS];
+static long   gsfs_fault_latency_ms = 1000;
+static atomic_long gsfs_faults_injected[GSFS_NUM_FAULTS];
+static pthread_once_t gsfs_fault_once = PTHREAD_ONCE_INIT;
+
+static void gsfs_fault_init(void)
+{
+	const char *spec = getenv("GSFS_FAULTS");
+	if(spec == NULL)
+		return;
+
+	char name[32];
+	double value;
+	int used;
+	while(sscanf(spec, " %31[^=]=%lf%n", name, &value, &used) == 2)
+	{
+		if(strcmp(name, "latency_ms") == 0)
+			gsfs_fault_latency_ms = value;
+		for(int i = 0; i < GSFS_NUM_FAULTS; i++)
+			if(strcmp(name, gsfs_fault_names[i]) == 0)
+				gsfs_fault_rates[i] = value;
+		spec += used;
+		if(*spec != ',')
+			break;
+		spec++;
+	}
+
+	log_msg("    fault injection: latency %g (%ld ms), drop %g, truncate %g, nomem %g\n",
+		gsfs_fault_rates[FAULT_LATENCY], gsfs_fault_latency_ms,
+		gsfs_fault_rates[FAULT_DROP], gsfs_fault_rates[FAULT_TRUNCATE],
+		gsfs_fault_rates[FAULT_NOMEM]);
+}
+
+// A cheap per-thread xorshift; all we need is for faults not to line up
+// with each other
+static double gsfs_fault_random(void)
+{
+	static _Thread_local unsigned long state = 0;
+	if(state == 0)
+		state = ((unsigned long) pthread_self() ^ (unsigned long) time(NULL)) | 1;
+	state ^= state << 13;
+	state ^= state >> 7;
+	state ^= state << 17;
+	return (state >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Should this call fail with the given fault?
+static int gsfs_fault(GSFS_Fault fault)
+{
+	pthread_once(&gsfs_fault_once, gsfs_fault_init);
+	if(gsfs_fault_rates[fault] <= 0 || gsfs_fault_random() >= gsfs_fault_rates[fault])
+		return 0;
+	atomic_fetch_add(&gsfs_faults_injected[fault], 1);
+	return 1;
+}
+
+#else
+
+#define gsfs_fault(fault) 0
+
+#endif
+
+// Called before every request to grooveshark: maybe stall it, maybe fail
+// it outright as if the connection dropped
+int gsfs_fault_request(void)
+{
+#ifdef GSFS_FAULT_INJECTION
+	if(gsfs_fault(FAULT_LATENCY))
+		usleep(gsfs_fault_latency_ms * 1000);
+#endif
+	if(gsfs_fault(FAULT_DROP))
+		return ERROR_CONNECTION_LOST;
+	return SUCCESS;
+}
+
+// Called with the length of a body of audio just fetched; maybe cut it
+// short, as a connection dropped mid-body would
+void gsfs_fault_body(size_t *len)
+{
+#ifdef GSFS_FAULT_INJECTION
+	if(*len > 0 && gsfs_fault(FAULT_TRUNCATE))
+		*len = (size_t) (gsfs_fault_random() * *len);
+#endif
+}
+
+// malloc, except when an allocation failure is due
+void *gsfs_fault_malloc(size_t size)
+{
+	if(gsfs_fault(FAULT_NOMEM))
+		return NULL;
+	return malloc(size);
+}
+
+void *gsfs_fault_calloc(size_t count, size_t size)
+{
+	if(gsfs_fault(FAULT_NOMEM))
+		return NULL;
+	return calloc(count, size);
+}
+
+void gsfs_fault_log(void)
+{
+#ifdef GSFS_FAULT_INJECTION
+	log_msg("    faults injected: %ld latency, %ld drop, %ld truncate, %ld nomem\n",
+		atomic_load(&gsfs_faults_injected[FAULT_LATENCY]),
+		atomic_load(&gsfs_faults_injected[FAULT_DROP]),
+		atomic_load(&gsfs_faults_injected[FAULT_TRUNCATE]),
+		atomic_load(&gsfs_faults_injected[FAULT_NOMEM]));
+#endif
+}
@@ -0,0 +1,304 @@
+/*
+  Access history and warm starts.
+
+  Reads are recorded in an access log kept with the disk cache: which
+  chunks of which recording were read, and when. When gsfs starts up, the
+  log left behind by earlier runs is read back, every chunk in it is
+  scored by how often and how recently it was read, and the best
+  gsfs_preload_chunks of them are fetched into the disk cache in the
+  background, at prefetch priority, so the first listeners after a
+  restart don't all start cold.
+
+  Chunks are preloaded into the disk cache rather than into memory:
+  nothing is registered yet when we start, so there are no songs to hang
+  them off.
+
+  The log is rotated as it's written: once it holds
+  GSFS_ACCESS_LOG_MAX / 2 records it's renamed to .access.log.1 (over
+  the one before) and started afresh, so the two together never hold
+  more than GSFS_ACCESS_LOG_MAX, however long we stay mounted.
+
+  A crash can leave a record half written at the end of a log; it's cut
+  off when the log is read back, so what's appended after it lines up.
+*/
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define GSFS_ACCESS_LOG ".access.log"
+#define GSFS_ACCESS_LOG_OLD ".access.log.1"
+
+// Records kept, across the log and the one rotated out before it
+#define GSFS_ACCESS_LOG_MAX (1024 * 1024)
+
+// A read this many seconds old counts half as much as one just now
+#define GSFS_ACCESS_HALF_LIFE (24 * 60 * 60)
+
+// Unflushed records we're willing to lose if we crash
+#define GSFS_ACCESS_LOG_FLUSH 64
+
+int gsfs_preload_chunks = 256;
+
+typedef struct {
+	int64_t  audio_id;  // 0 if grooveshark gave the song none
+	int64_t  song_id;
+	uint32_t time;
+	uint16_t first;   // chunks read, inclusive
+	uint16_t last;
+} GSFS_Access_Record;
+
+static pthread_mutex_t gsfs_access_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *gsfs_access_log = NULL;
+static int   gsfs_access_unflushed = 0;
+static long  gsfs_access_logged = 0;   // records in the current log
+static char  gsfs_access_path[PATH_MAX];
+static char  gsfs_access_old_path[PATH_MAX];
+
+// Move the current log aside and start a new one. Called with
+// gsfs_access_lock held.
+static void gsfs_access_rotate(void)
+{
+	if(gsfs_access_log != NULL)
+		fclose(gsfs_access_log);
+	rename(gsfs_access_path, gsfs_access_old_path);
+	gsfs_access_log = fopen(gsfs_access_path, "wb");
+	if(gsfs_access_log == NULL)
+		log_msg("    ERROR access log %s: %s\n", gsfs_access_path, strerror(errno));
+	gsfs_access_logged = 0;
+	gsfs_access_unflushed = 0;
+}
+
+// Note that chunks first to last of a song were read
+void gsfs_access_record(Song *song, int first, int last)
+{
+	GSFS_Access_Record record = {
+		song->audio_id, song->song_id, time(NULL), first, last
+	};
+
+	pthread_mutex_lock(&gsfs_access_lock);
+	if(gsfs_access_log != NULL)
+	{
+		fwrite(&record, sizeof(record), 1, gsfs_access_log);
+		if(++gsfs_access_logged >= GSFS_ACCESS_LOG_MAX / 2)
+			gsfs_access_rotate();
+		else if(++gsfs_access_unflushed >= GSFS_ACCESS_LOG_FLUSH)
+		{
+			fflush(gsfs_access_log);
+			gsfs_access_unflushed = 0;
+		}
+	}
+	pthread_mutex_unlock(&gsfs_access_lock);
+}
+
+typedef struct {
+	int64_t audio_id;
+	int64_t song_id;
+	int     chunk;
+	double  score;
+	int     used;
+} GSFS_Preload_Entry;
+
+typedef struct {
+	GSFS_Preload_Entry *entries;
+	int count;
+	int next;
+	int preloaded;
+} GSFS_Preload;
+
+// Chunks are told apart by recording, or by song for songs grooveshark
+// gives no audio id
+static unsigned long gsfs_preload_hash(GSFS_Access_Record *record, int chunk)
+{
+	unsigned long id = record->audio_id != 0 ? record->audio_id : record->song_id;
+	return (id * 2654435761UL) ^ ((unsigned long) chunk * 40503UL);
+}
+
+static int gsfs_preload_match(GSFS_Preload_Entry *entry, GSFS_Access_Record *record, int chunk)
+{
+	return entry->audio_id == record->audio_id && entry->chunk == chunk
+		&& (record->audio_id != 0 || entry->song_id == record->song_id);
+}
+
+static int gsfs_preload_compare(const void *a, const void *b)
+{
+	double x = ((GSFS_Preload_Entry *) a)->score;
+	double y = ((GSFS_Preload_Entry *) b)->score;
+	return x > y ? -1 : x < y;
+}
+
+// Preload one chunk, then queue the job again for the next, so a warm
+// start never holds on to a prefetch slot for long. The job is queued
+// with a delay to stay under the prefetch bandwidth limit, rather than
+// sleeping it off on a worker.
+static void gsfs_preload_job(void *arg, int cancelled)
+{
+	GSFS_Preload *preload = arg;
+
+	if(!cancelled && preload->next < preload->count)
+	{
+		GSFS_Preload_Entry *entry = &(preload->entries[preload->next++]);
+		if(gsfs_disk_cache_preload(entry->audio_id, entry->song_id, entry->chunk) == SUCCESS)
+			preload->preloaded++;
+
+		if(preload->next < preload->count)
+		{
+			size_t rate = atomic_load(&gsfs_prefetch_rate);
+			gsfs_sched_submit_after(GSFS_PRIO_PREFETCH, NULL, gsfs_preload_job, preload,
+				rate > 0 ? (long) ((double) GSFS_CHUNK_SIZE * 1000 / rate) : 0);
+			return;
+		}
+	}
+
+	log_msg("    warm start: preloaded %d of %d chunks\n", preload->preloaded, preload->count);
+	free(preload->entries);
+	free(preload);
+}
+
+// Score every chunk in the records and queue the best of them to be
+// preloaded
+static void gsfs_preload(GSFS_Access_Record *records, size_t num_records)
+{
+	size_t num_chunks = 0;
+	for(size_t i = 0; i < num_records; i++)
+		if(records[i].last >= records[i].first)
+			num_chunks += records[i].last - records[i].first + 1;
+	if(num_chunks == 0 || gsfs_preload_chunks <= 0)
+		return;
+
+	// an open addressed table, at most half full
+	size_t capacity = 1;
+	while(capacity < 2 * num_chunks)
+		capacity *= 2;
+	GSFS_Preload_Entry *table = calloc(capacity, sizeof(GSFS_Preload_Entry));
+	if(table == NULL)
+		return;
+
+	time_t now = time(NULL);
+	for(size_t i = 0; i < num_records; i++)
+	{
+		GSFS_Access_Record *record = &(records[i]);
+		double age = now > record->time ? now - record->time : 0;
+		double weight = 1 / (1 + age / GSFS_ACCESS_HALF_LIFE);
+
+		for(int chunk = record->first; chunk <= record->last; chunk++)
+		{
+			size_t slot = gsfs_preload_hash(record, chunk) & (capacity - 1);
+			while(table[slot].used && !gsfs_preload_match(&(table[slot]), record, chunk))
+				slot = (slot + 1) & (capacity - 1);
+
+			table[slot].used = 1;
+			table[slot].audio_id = record->audio_id;
+			table[slot].song_id = record->song_id;
+			table[slot].chunk = chunk;
+			table[slot].score += weight;
+		}
+	}
+
+	// pack the entries to the front, best first
+	size_t count = 0;
+	for(size_t i = 0; i < capacity; i++)
+		if(table[i].used)
+			table[count++] = table[i];
+	qsort(table, count, sizeof(GSFS_Preload_Entry), gsfs_preload_compare);
+	if(count > gsfs_preload_chunks)
+		count = gsfs_preload_chunks;
+
+	GSFS_Preload *preload = calloc(1, sizeof(GSFS_Preload));
+	if(preload == NULL)
+	{
+		free(table);
+		return;
+	}
+	preload->entries = table;
+	preload->count = count;
+	gsfs_sched_submit(GSFS_PRIO_PREFETCH, NULL, gsfs_preload_job, preload);
+}
+
+// How many records the log at path holds, and how many of the newest of
+// them are worth reading back. A record left half written is cut off.
+static size_t gsfs_access_count(const char *path, size_t *wanted)
+{
+	struct stat st;
+	size_t in_log = 0;
+	if(stat(path, &st) == 0)
+	{
+		in_log = st.st_size / sizeof(GSFS_Access_Record);
+		if(in_log * sizeof(GSFS_Access_Record) < st.st_size
+			&& truncate(path, in_log * sizeof(GSFS_Access_Record)) != 0)
+			log_msg("    ERROR access log %s: %s\n", path, strerror(errno));
+	}
+	*wanted = in_log < GSFS_ACCESS_LOG_MAX / 2 ? in_log : GSFS_ACCESS_LOG_MAX / 2;
+	return in_log;
+}
+
+// Append the newest wanted of the in_log records of the log at path to
+// records
+static void gsfs_access_load(
+	const char *path,
+	size_t in_log,
+	size_t wanted,
+	GSFS_Access_Record *records,
+	size_t *num_records)
+{
+	FILE *log = fopen(path, "rb");
+	if(log == NULL)
+		return;
+
+	if(fseek(log, (long) ((in_log - wanted) * sizeof(GSFS_Access_Record)), SEEK_SET) == 0)
+		*num_records += fread(records + *num_records, sizeof(GSFS_Access_Record), wanted, log);
+	fclose(log);
+}
+
+// Read back the access logs in dir, start preloading from them, and open
+// the log to record this run's reads
+void gsfs_history_init(const char *dir)
+{
+	snprintf(gsfs_access_path, PATH_MAX, "%s/%s", dir, GSFS_ACCESS_LOG);
+	snprintf(gsfs_access_old_path, PATH_MAX, "%s/%s", dir, GSFS_ACCESS_LOG_OLD);
+
+	size_t old_wanted, wanted;
+	size_t in_old = gsfs_access_count(gsfs_access_old_path, &old_wanted);
+	size_t in_log = gsfs_access_count(gsfs_access_path, &wanted);
+
+	size_t num_records = 0;
+	GSFS_Access_Record *records = malloc((old_wanted + wanted + 1) * sizeof(GSFS_Access_Record));
+	if(records != NULL)
+	{
+		gsfs_access_load(gsfs_access_old_path, in_old, old_wanted, records, &num_records);
+		gsfs_access_load(gsfs_access_path, in_log, wanted, records, &num_records);
+	}
+
+	if(num_records > 0)
+		gsfs_preload(records, num_records);
+	free(records);
+
+	pthread_mutex_lock(&gsfs_access_lock);
+	// a log left over from before logs were rotated may be any length
+	if(in_log >= GSFS_ACCESS_LOG_MAX / 2)
+		gsfs_access_rotate();
+	else
+	{
+		gsfs_access_log = fopen(gsfs_access_path, "ab");
+		if(gsfs_access_log == NULL)
+			log_msg("    ERROR access log %s: %s\n", gsfs_access_path, strerror(errno));
+		gsfs_access_logged = in_log;
+	}
+	pthread_mutex_unlock(&gsfs_access_lock);
+}
+
+void gsfs_history_close(void)
+{
+	pthread_mutex_lock(&gsfs_access_lock);
+	if(gsfs_access_log != NULL)
+		fclose(gsfs_access_log);
+	gsfs_access_log = NULL;
+	pthread_mutex_unlock(&gsfs_access_lock);
+}
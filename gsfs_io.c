@@ -0,0 +1,221 @@
+/*
+  Asynchronous I/O engine.
+
+  Writes to the disk cache go through here, so that whoever fetched a
+  chunk can hand it off and get on with the next one. When liburing is
+  available (HAVE_LIBURING) and the kernel supports it, requests are
+  submitted to an io_uring and a single completion thread runs their
+  callbacks; otherwise they are handed to a small pool of threads that
+  issue plain pread()/pwrite() calls. Setting GSFS_IO=threads in the
+  environment picks the thread pool even where io_uring would work.
+
+  Callbacks run on the engine's own threads -- with io_uring, the one
+  completion thread every other request waits behind -- so they should
+  hand anything slow on to a job.
+
+  Nothing waits on a request here. FUSE's high-level API wants its reply
+  from the callback itself, so a read of the disk cache would only add a
+  trip through another thread to a pread() the reader has to wait for
+  anyway; those are issued directly. Fetches from grooveshark are the
+  client library's own blocking socket I/O and stay on the scheduler's
+  workers.
+
+  gcc ... gsfs_io.c -luring
+*/
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#define GSFS_IO_THREADS 4
+#define GSFS_IO_QUEUE_DEPTH 256
+
+typedef enum {
+	GSFS_IO_READ,
+	GSFS_IO_WRITE
+} GSFS_IO_Op;
+
+typedef void (*gsfs_io_callback)(void *arg, ssize_t result);
+
+typedef struct GSFS_IO_Request {
+	GSFS_IO_Op op;
+	int    fd;
+	void  *buf;
+	size_t len;
+	off_t  offset;
+	gsfs_io_callback callback;
+	void  *arg;
+	struct GSFS_IO_Request *next;
+} GSFS_IO_Request;
+
+// Which engine gsfs_io_init() ended up with
+static int gsfs_io_uring_enabled = 0;
+
+#ifdef HAVE_LIBURING
+static struct io_uring gsfs_ring;
+static pthread_mutex_t gsfs_ring_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *gsfs_io_uring_thread(void *arg)
+{
+	for(;;)
+	{
+		struct io_uring_cqe *cqe;
+		if(io_uring_wait_cqe(&gsfs_ring, &cqe) < 0)
+			continue;
+
+		GSFS_IO_Request *request = io_uring_cqe_get_data(cqe);
+		ssize_t result = cqe->res;
+		io_uring_cqe_seen(&gsfs_ring, cqe);
+
+		request->callback(request->arg, result);
+		free(request);
+	}
+	return NULL;
+}
+
+static int gsfs_io_uring_submit(GSFS_IO_Request *request)
+{
+	pthread_mutex_lock(&gsfs_ring_lock);
+
+	struct io_uring_sqe *sqe = io_uring_get_sqe(&gsfs_ring);
+	if(sqe == NULL)
+	{
+		// the ring is full; push what's queued and try once more
+		io_uring_submit(&gsfs_ring);
+		sqe = io_uring_get_sqe(&gsfs_ring);
+	}
+	if(sqe == NULL)
+	{
+		pthread_mutex_unlock(&gsfs_ring_lock);
+		return EAGAIN;
+	}
+
+	if(request->op == GSFS_IO_READ)
+		io_uring_prep_read(sqe, request->fd, request->buf, request->len, request->offset);
+	else
+		io_uring_prep_write(sqe, request->fd, request->buf, request->len, request->offset);
+	io_uring_sqe_set_data(sqe, request);
+	io_uring_submit(&gsfs_ring);
+
+	pthread_mutex_unlock(&gsfs_ring_lock);
+	return SUCCESS;
+}
+#endif
+
+// Thread pool fallback, for kernels (or builds) without io_uring
+static pthread_mutex_t gsfs_io_queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  gsfs_io_queue_cond = PTHREAD_COND_INITIALIZER;
+static GSFS_IO_Request *gsfs_io_queue_head = NULL;
+static GSFS_IO_Request *gsfs_io_queue_tail = NULL;
+
+static void *gsfs_io_pool_thread(void *arg)
+{
+	for(;;)
+	{
+		pthread_mutex_lock(&gsfs_io_queue_lock);
+		while(gsfs_io_queue_head == NULL)
+			pthread_cond_wait(&gsfs_io_queue_cond, &gsfs_io_queue_lock);
+
+		GSFS_IO_Request *request = gsfs_io_queue_head;
+		gsfs_io_queue_head = request->next;
+		if(gsfs_io_queue_head == NULL)
+			gsfs_io_queue_tail = NULL;
+		pthread_mutex_unlock(&gsfs_io_queue_lock);
+
+		ssize_t result;
+		if(request->op == GSFS_IO_READ)
+			result = pread(request->fd, request->buf, request->len, request->offset);
+		else
+			result = pwrite(request->fd, request->buf, request->len, request->offset);
+		if(result < 0)
+			result = -errno;
+
+		request->callback(request->arg, result);
+		free(request);
+	}
+	return NULL;
+}
+
+static int gsfs_io_pool_submit(GSFS_IO_Request *request)
+{
+	pthread_mutex_lock(&gsfs_io_queue_lock);
+	if(gsfs_io_queue_tail != NULL)
+		gsfs_io_queue_tail->next = request;
+	else
+		gsfs_io_queue_head = request;
+	gsfs_io_queue_tail = request;
+	pthread_cond_signal(&gsfs_io_queue_cond);
+	pthread_mutex_unlock(&gsfs_io_queue_lock);
+	return SUCCESS;
+}
+
+// Start the I/O engine, preferring io_uring unless told not to
+int gsfs_io_init(int use_uring)
+{
+	pthread_t thread;
+
+#ifdef HAVE_LIBURING
+	if(use_uring && io_uring_queue_init(GSFS_IO_QUEUE_DEPTH, &gsfs_ring, 0) == 0)
+	{
+		if(pthread_create(&thread, NULL, gsfs_io_uring_thread, NULL) == 0)
+		{
+			pthread_detach(thread);
+			gsfs_io_uring_enabled = 1;
+			log_msg("    gsfs_io_init: using io_uring\n");
+			return SUCCESS;
+		}
+		io_uring_queue_exit(&gsfs_ring);
+	}
+#endif
+
+	for(int i = 0; i < GSFS_IO_THREADS; i++)
+	{
+		if(pthread_create(&thread, NULL, gsfs_io_pool_thread, NULL) != 0)
+			return i == 0 ? EAGAIN : SUCCESS;
+		pthread_detach(thread);
+	}
+	log_msg("    gsfs_io_init: using %d I/O threads\n", GSFS_IO_THREADS);
+	return SUCCESS;
+}
+
+// Queue a read or write; callback is called with the byte count, or a
+// negative errno, once it completes
+int gsfs_io_submit(
+	GSFS_IO_Op op,
+	int fd,
+	void *buf,
+	size_t len,
+	off_t offset,
+	gsfs_io_callback callback,
+	void *arg)
+{
+	GSFS_IO_Request *request = calloc(1, sizeof(GSFS_IO_Request));
+	if(request == NULL)
+		return ENOMEM;
+
+	request->op = op;
+	request->fd = fd;
+	request->buf = buf;
+	request->len = len;
+	request->offset = offset;
+	request->callback = callback;
+	request->arg = arg;
+
+	int error;
+#ifdef HAVE_LIBURING
+	if(gsfs_io_uring_enabled)
+		error = gsfs_io_uring_submit(request);
+	else
+#endif
+		error = gsfs_io_pool_submit(request);
+
+	if(error != SUCCESS)
+		free(request);
+	return error;
+}
@@ -0,0 +1,230 @@
+/*
+  What a song's first MP3 frame says about it.
+
+  The first time the chunk a song's audio starts in arrives -- the first
+  chunk, unless an ID3v2 tag grooveshark left in runs on past it -- we
+  parse it for the first MPEG audio frame and, if there is one, the Xing
+  (or "Info") or VBRI header LAME and Fraunhofer encoders put in it.
+  From those we know the song's duration and average bitrate without
+  touching the rest of the audio. Constant bitrate songs without either
+  header are worked out from the first frame's bitrate and the song's
+  size.
+
+  This is also where the ID3 tags we put in front of songs are written.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+typedef struct GSFS_MP3_Info {
+	int   bitrate;      // kbit/s; the average, for variable bitrate songs
+	int   sample_rate;
+	long  duration_ms;
+	off_t audio_start;  // the first frame, after any ID3v2 tag
+} GSFS_MP3_Info;
+
+static const int gsfs_mp3_bitrates[2][16] = {
+	// MPEG 1 layer III
+	{ 0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 0 },
+	// MPEG 2 and 2.5 layer III
+	{ 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0 }
+};
+
+static const int gsfs_mp3_sample_rates[3] = { 44100, 48000, 32000 };
+
+typedef struct {
+	int mpeg1;          // otherwise MPEG 2 or 2.5
+	int bitrate;
+	int sample_rate;
+	int mono;
+	int samples;        // per frame
+	int length;         // bytes, including the header
+} GSFS_MP3_Frame;
+
+static unsigned long gsfs_be32(const unsigned char *p)
+{
+	return ((unsigned long) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+// Decode the layer III frame header at p; 0 if it isn't one
+static int gsfs_mp3_frame_header(const unsigned char *p, GSFS_MP3_Frame *frame)
+{
+	if(p[0] != 0xff || (p[1] & 0xe0) != 0xe0)
+		return 0;
+
+	int version = (p[1] >> 3) & 3;      // 0 = 2.5, 2 = 2, 3 = 1
+	int layer = (p[1] >> 1) & 3;        // 1 = layer III
+	int bitrate_index = p[2] >> 4;
+	int rate_index = (p[2] >> 2) & 3;
+	int padding = (p[2] >> 1) & 1;
+
+	if(version == 1 || layer != 1 || rate_index == 3
+		|| gsfs_mp3_bitrates[0][bitrate_index] == 0)
+		return 0;
+
+	frame->mpeg1 = version == 3;
+	frame->bitrate = gsfs_mp3_bitrates[frame->mpeg1 ? 0 : 1][bitrate_index];
+	frame->sample_rate = gsfs_mp3_sample_rates[rate_index];
+	if(version == 2)
+		frame->sample_rate /= 2;
+	else if(version == 0)
+		frame->sample_rate /= 4;
+	frame->mono = (p[3] >> 6) == 3;
+	frame->samples = frame->mpeg1 ? 1152 : 576;
+	frame->length = (frame->mpeg1 ? 144 : 72) * frame->bitrate * 1000
+		/ frame->sample_rate + padding;
+	return 1;
+}
+
+// Size of the ID3v2 tag at the start of a song, going by its first len
+// bytes, if there is one. It may run on past them.
+size_t gsfs_id3v2_length(const unsigned char *data, size_t len)
+{
+	if(len < 10 || memcmp(data, "ID3", 3) != 0)
+		return 0;
+	size_t size = ((size_t) (data[6] & 0x7f) << 21) | ((data[7] & 0x7f) << 14)
+		| ((data[8] & 0x7f) << 7) | (data[9] & 0x7f);
+	// a footer repeats the header
+	return 10 + size + ((data[5] & 0x10) ? 10 : 0);
+}
+
+// Work out what we can about a song from the len bytes of it at offset,
+// where its audio starts, tag_end bytes in (see gsfs_id3v2_length()).
+// file_size is the size of the whole song. Returns NULL if we can't make
+// sense of it.
+GSFS_MP3_Info *gsfs_mp3_info_build(
+	const unsigned char *data,
+	size_t len,
+	off_t offset,
+	off_t tag_end,
+	size_t file_size)
+{
+	GSFS_MP3_Frame frame;
+	size_t start = tag_end > offset ? tag_end - offset : 0;
+
+	// find the first frame; some encoders leave junk after the tag
+	while(start + 4 <= len && !gsfs_mp3_frame_header(data + start, &frame))
+		start++;
+	if(start + 4 > len)
+		return NULL;
+
+	const unsigned char *header = data + start;
+	size_t side_info = frame.mpeg1 ? (frame.mono ? 17 : 32) : (frame.mono ? 9 : 17);
+	const unsigned char *xing = header + 4 + side_info;
+	const unsigned char *vbri = header + 4 + 32;
+	size_t audio_bytes = file_size - (offset + start);
+	long duration = 0;
+
+	if(xing + 8 <= data + len
+		&& (memcmp(xing, "Xing", 4) == 0 || memcmp(xing, "Info", 4) == 0))
+	{
+		unsigned long flags = gsfs_be32(xing + 4);
+		const unsigned char *field = xing + 8;
+		unsigned long frames = 0;
+
+		if(flags & 1)
+		{
+			if(field + 4 > data + len)
+				return NULL;
+			frames = gsfs_be32(field);
+			field += 4;
+		}
+		if(flags & 2)
+		{
+			if(field + 4 > data + len)
+				return NULL;
+			audio_bytes = gsfs_be32(field);
+		}
+		if(frames == 0)
+			return NULL;
+		duration = (long) ((double) frames * frame.samples * 1000 / frame.sample_rate);
+	}
+	else if(vbri + 18 <= data + len && memcmp(vbri, "VBRI", 4) == 0)
+	{
+		audio_bytes = gsfs_be32(vbri + 10);
+		unsigned long frames = gsfs_be32(vbri + 14);
+		if(frames == 0)
+			return NULL;
+		duration = (long) ((double) frames * frame.samples * 1000 / frame.sample_rate);
+	}
+	else
+	{
+		// no header; assume the whole song is at the first frame's bitrate
+		duration = (long) ((double) audio_bytes * 8 / frame.bitrate);
+	}
+
+	GSFS_MP3_Info *info = calloc(1, sizeof(GSFS_MP3_Info));
+	if(info == NULL)
+		return NULL;
+	info->duration_ms = duration;
+	info->audio_start = offset + start;
+	info->sample_rate = frame.sample_rate;
+	info->bitrate = duration > 0
+		? (int) ((double) audio_bytes * 8 / duration)
+		: frame.bitrate;
+	return info;
+}
+
+// Songs are served with an ID3v2.4 tag built from the catalog in front
+// of grooveshark's audio, so players and scanners that read the tag
+// never have to wait for (or fetch) any audio. Any tag grooveshark's
+// audio carries itself is left in place behind ours.
+static void gsfs_syncsafe(unsigned char *out, size_t value)
+{
+	out[0] = (value >> 21) & 0x7f;
+	out[1] = (value >> 14) & 0x7f;
+	out[2] = (value >> 7) & 0x7f;
+	out[3] = value & 0x7f;
+}
+
+// A UTF-8 text frame; written at out unless out is NULL, returning its size
+static size_t gsfs_id3_frame(unsigned char *out, const char *id, const char *text)
+{
+	size_t len = strlen(text) + 1;  // with the encoding byte
+	if(out != NULL)
+	{
+		memcpy(out, id, 4);
+		gsfs_syncsafe(out + 4, len);
+		out[8] = 0;
+		out[9] = 0;
+		out[10] = 3;
+		memcpy(out + 11, text, len - 1);
+	}
+	return 10 + len;
+}
+
+// Write a tag at out, or with out NULL, work out how big it would be
+size_t gsfs_id3_tag(
+	unsigned char *out,
+	const char *title,
+	const char *artist,
+	const char *album,
+	int track,
+	long duration_ms)
+{
+	char number[32];
+	size_t len = 10;
+
+	len += gsfs_id3_frame(out != NULL ? out + len : NULL, "TIT2", title);
+	len += gsfs_id3_frame(out != NULL ? out + len : NULL, "TPE1", artist);
+	len += gsfs_id3_frame(out != NULL ? out + len : NULL, "TALB", album);
+	snprintf(number, sizeof(number), "%d", track);
+	len += gsfs_id3_frame(out != NULL ? out + len : NULL, "TRCK", number);
+	if(duration_ms > 0)
+	{
+		snprintf(number, sizeof(number), "%ld", duration_ms);
+		len += gsfs_id3_frame(out != NULL ? out + len : NULL, "TLEN", number);
+	}
+
+	if(out != NULL)
+	{
+		memcpy(out, "ID3", 3);
+		out[3] = 4;
+		out[4] = 0;
+		out[5] = 0;
+		gsfs_syncsafe(out + 6, len - 10);
+	}
+	return len;
+}
@@ -0,0 +1,493 @@
+/*
+  Artist name matching.
+
+  People type artist names however they like: "daft punk", "Daft Punk"
+  and "Daft Punk " should all mean the same artist, and none of them
+  should cost a round trip to grooveshark once we know about it. So
+  every name is reduced to a normalized key before it is compared:
+
+    - ASCII letters are folded to lower case
+    - accented Latin-1 letters are folded to their base letter, and
+      combining accents are dropped, so precomposed and decomposed
+      spellings agree
+    - whitespace and punctuation are dropped
+
+  A name with nothing left once that's done (all punctuation, say) keeps
+  its exact bytes as its key instead, so that "!!!" and "???" don't both
+  come out as the same empty key.
+
+  Three structures are kept over those keys:
+
+    - the artist index, mapping keys of registered artists to the
+      Artist (more than one key can map to an artist, when it was
+      registered under a misspelling)
+    - the negative cache, holding keys grooveshark recently told us
+      don't exist, so repeating a bad mkdir fails without a round trip
+    - a BK-tree of every artist name grooveshark has confirmed, so a
+      near miss can be corrected to a name we know will register
+*/
+
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// How long a name grooveshark rejected stays rejected, in seconds
+#define GSFS_NEGATIVE_TTL (60 * 60)
+
+// Folds for U+00C0..U+00FF (the second byte of 0xC3 0x80..0xBF); 0 means
+// the character is dropped
+static const char gsfs_latin1_fold[64] =
+	"aaaaaaaceeeeiiii" // À..Ï
+	"dnooooo\0ouuuuyts" // Ð..ß (× dropped, Þ->t, ß->s)
+	"aaaaaaaceeeeiiii" // à..ï
+	"dnooooo\0ouuuuyty"; // ð..ÿ (÷ dropped)
+
+// Reduce a name to its normalized key
+void gsfs_normalize_name(const char *name, char key[MAX_PATH])
+{
+	const unsigned char *in = (const unsigned char *) name;
+	int j = 0;
+
+	while(*in != 0 && j < MAX_PATH - 4)
+	{
+		unsigned char c = *in;
+
+		if(c < 0x80)
+		{
+			// letters and digits survive, folded; everything else goes
+			if(isalnum(c))
+				key[j++] = tolower(c);
+			in++;
+		}
+		else if(c == 0xC3 && in[1] >= 0x80 && in[1] <= 0xBF)
+		{
+			char folded = gsfs_latin1_fold[in[1] - 0x80];
+			if(folded != 0)
+				key[j++] = folded;
+			in += 2;
+		}
+		else if((c == 0xCC && in[1] >= 0x80 && in[1] <= 0xBF)
+			|| (c == 0xCD && in[1] >= 0x80 && in[1] <= 0xAF))
+		{
+			// combining diacritical marks, U+0300..U+036F
+			in += 2;
+		}
+		else if(c == 0xC2 && in[1] >= 0x80 && in[1] <= 0xBF)
+		{
+			// Latin-1 punctuation and no-break space, U+0080..U+00BF
+			in += 2;
+		}
+		else
+		{
+			// anything else is kept exactly, one whole character at a time
+			int len = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : 2;
+			for(int k = 0; k < len && *in != 0; k++)
+				key[j++] = *in++;
+		}
+	}
+	key[j] = '\0';
+
+	// nothing survived; the name stands for itself
+	if(j == 0)
+	{
+		strncpy(key, name, MAX_PATH - 1);
+		key[MAX_PATH - 1] = '\0';
+	}
+}
+
+// A chained hash table from normalized keys to artists
+typedef struct GSFS_Name_Entry {
+	char   *key;
+	Artist *artist;
+	time_t  added;
+	struct GSFS_Name_Entry *next;
+} GSFS_Name_Entry;
+
+typedef struct {
+	GSFS_Name_Entry **buckets;
+	size_t num_buckets;
+	size_t num_entries;
+} GSFS_Name_Table;
+
+static unsigned long gsfs_name_hash(const char *key)
+{
+	// FNV-1a
+	unsigned long hash = 2166136261u;
+	while(*key != 0)
+		hash = (hash ^ (unsigned char) *key++) * 16777619u;
+	return hash;
+}
+
+static GSFS_Name_Entry **gsfs_name_table_find(GSFS_Name_Table *table, const char *key)
+{
+	if(table->num_buckets == 0)
+		return NULL;
+
+	GSFS_Name_Entry **entry = &(table->buckets[gsfs_name_hash(key) % table->num_buckets]);
+	while(*entry != NULL && strcmp((*entry)->key, key) != 0)
+		entry = &((*entry)->next);
+	return entry;
+}
+
+// Double the number of buckets once there are more entries than buckets
+static int gsfs_name_table_grow(GSFS_Name_Table *table)
+{
+	if(table->num_entries < table->num_buckets)
+		return SUCCESS;
+
+	size_t num_buckets = table->num_buckets ? table->num_buckets * 2 : 256;
+	GSFS_Name_Entry **buckets = calloc(num_buckets, sizeof(GSFS_Name_Entry *));
+	if(buckets == NULL)
+		return ENOMEM;
+
+	for(size_t i = 0; i < table->num_buckets; i++)
+	{
+		GSFS_Name_Entry *entry = table->buckets[i];
+		while(entry != NULL)
+		{
+			GSFS_Name_Entry *next = entry->next;
+			size_t bucket = gsfs_name_hash(entry->key) % num_buckets;
+			entry->next = buckets[bucket];
+			buckets[bucket] = entry;
+			entry = next;
+		}
+	}
+
+	free(table->buckets);
+	table->buckets = buckets;
+	table->num_buckets = num_buckets;
+	return SUCCESS;
+}
+
+static int gsfs_name_table_put(GSFS_Name_Table *table, const char *key, Artist *artist)
+{
+	if(gsfs_name_table_grow(table) != SUCCESS)
+		return ENOMEM;
+
+	GSFS_Name_Entry **slot = gsfs_name_table_find(table, key);
+	if(*slot == NULL)
+	{
+		GSFS_Name_Entry *entry = calloc(1, sizeof(GSFS_Name_Entry));
+		if(entry == NULL)
+			return ENOMEM;
+		entry->key = strdup(key);
+		if(entry->key == NULL)
+		{
+			free(entry);
+			return ENOMEM;
+		}
+		*slot = entry;
+		table->num_entries++;
+	}
+	(*slot)->artist = artist;
+	(*slot)->added = time(NULL);
+	return SUCCESS;
+}
+
+static void gsfs_name_table_unlink(GSFS_Name_Table *table, GSFS_Name_Entry **slot)
+{
+	GSFS_Name_Entry *entry = *slot;
+	*slot = entry->next;
+	free(entry->key);
+	free(entry);
+	table->num_entries--;
+}
+
+// A BK-tree over the keys of names grooveshark has confirmed. Each child
+// is filed under its edit distance from its parent, so a search only has
+// to visit children whose distance is within tolerance of the target's.
+typedef struct GSFS_BK_Node {
+	char *key;
+	char  name[MAX_PATH]; // the name as grooveshark spells it
+	int   num_children;
+	int  *distances;
+	struct GSFS_BK_Node **children;
+} GSFS_BK_Node;
+
+static GSFS_Name_Table gsfs_artist_index;
+static GSFS_Name_Table gsfs_negative_cache;
+static GSFS_BK_Node   *gsfs_known_artists = NULL;
+static pthread_rwlock_t gsfs_names_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static int gsfs_edit_distance(const char *a, const char *b)
+{
+	int len_b = strlen(b);
+	int *row = malloc((len_b + 1) * sizeof(int));
+	if(row == NULL)
+		return MAX_PATH;
+
+	for(int j = 0; j <= len_b; j++)
+		row[j] = j;
+
+	for(int i = 1; a[i - 1] != 0; i++)
+	{
+		int diagonal = row[0];
+		row[0] = i;
+		for(int j = 1; j <= len_b; j++)
+		{
+			int above = row[j];
+			int cost = a[i - 1] == b[j - 1] ? 0 : 1;
+			int best = diagonal + cost;
+			if(above + 1 < best)
+				best = above + 1;
+			if(row[j - 1] + 1 < best)
+				best = row[j - 1] + 1;
+			row[j] = best;
+			diagonal = above;
+		}
+	}
+
+	int distance = row[len_b];
+	free(row);
+	return distance;
+}
+
+static void gsfs_bk_insert(const char *key, const char *name)
+{
+	GSFS_BK_Node **node = &gsfs_known_artists;
+
+	while(*node != NULL)
+	{
+		int distance = gsfs_edit_distance(key, (*node)->key);
+		if(distance == 0)
+			return;
+
+		GSFS_BK_Node *parent = *node;
+		node = NULL;
+		for(int i = 0; i < parent->num_children; i++)
+			if(parent->distances[i] == distance)
+				node = &(parent->children[i]);
+
+		if(node == NULL)
+		{
+			// no child at this distance yet; make room for one
+			int n = parent->num_children + 1;
+			int *distances = realloc(parent->distances, n * sizeof(int));
+			if(distances == NULL)
+				return;
+			parent->distances = distances;
+			GSFS_BK_Node **children = realloc(parent->children, n * sizeof(GSFS_BK_Node *));
+			if(children == NULL)
+				return;
+			parent->children = children;
+
+			parent->distances[n - 1] = distance;
+			parent->children[n - 1] = NULL;
+			parent->num_children = n;
+			node = &(parent->children[n - 1]);
+		}
+	}
+
+	GSFS_BK_Node *leaf = calloc(1, sizeof(GSFS_BK_Node));
+	if(leaf == NULL)
+		return;
+	leaf->key = strdup(key);
+	if(leaf->key == NULL)
+	{
+		free(leaf);
+		return;
+	}
+	strncpy(leaf->name, name, MAX_PATH - 1);
+	*node = leaf;
+}
+
+static void gsfs_bk_search(
+	GSFS_BK_Node *node,
+	const char *key,
+	int tolerance,
+	GSFS_BK_Node **best,
+	int *best_distance)
+{
+	if(node == NULL)
+		return;
+
+	int distance = gsfs_edit_distance(key, node->key);
+	if(distance <= tolerance && distance < *best_distance)
+	{
+		*best = node;
+		*best_distance = distance;
+	}
+
+	for(int i = 0; i < node->num_children; i++)
+		if(abs(node->distances[i] - distance) <= tolerance)
+			gsfs_bk_search(node->children[i], key, tolerance, best, best_distance);
+}
+
+// Short names get less room for typos, or everything would match
+static int gsfs_name_tolerance(const char *key)
+{
+	int len = strlen(key);
+	return len <= 3 ? 0 : len <= 6 ? 1 : 2;
+}
+
+// Find the registered artist with this (normalized) name
+Artist *gsfs_name_index_lookup(const char *name)
+{
+	char key[MAX_PATH];
+	Artist *artist = NULL;
+
+	gsfs_normalize_name(name, key);
+
+	pthread_rwlock_rdlock(&gsfs_names_lock);
+	GSFS_Name_Entry **entry = gsfs_name_table_find(&gsfs_artist_index, key);
+	if(entry != NULL && *entry != NULL)
+		artist = (*entry)->artist;
+	pthread_rwlock_unlock(&gsfs_names_lock);
+
+	return artist;
+}
+
+// Index an artist under a name. The name is also remembered as one
+// grooveshark knows, for correcting near misses later.
+int gsfs_name_index_add(const char *name, Artist *artist)
+{
+	char key[MAX_PATH];
+	int error;
+
+	gsfs_normalize_name(name, key);
+
+	pthread_rwlock_wrlock(&gsfs_names_lock);
+	error = gsfs_name_table_put(&gsfs_artist_index, key, artist);
+	if(error == SUCCESS && strcmp(name, artist->name) == 0)
+		gsfs_bk_insert(key, name);
+	pthread_rwlock_unlock(&gsfs_names_lock);
+
+	return error;
+}
+
+// Take every name an artist is indexed under out of the index. The
+// entries are handed back, chained together, so they can be put back
+// with gsfs_name_index_restore() or let go of with gsfs_name_index_free().
+GSFS_Name_Entry *gsfs_name_index_remove(Artist *artist)
+{
+	GSFS_Name_Entry *removed = NULL;
+
+	pthread_rwlock_wrlock(&gsfs_names_lock);
+	for(size_t i = 0; i < gsfs_artist_index.num_buckets; i++)
+	{
+		GSFS_Name_Entry **slot = &(gsfs_artist_index.buckets[i]);
+		while(*slot != NULL)
+		{
+			GSFS_Name_Entry *entry = *slot;
+			if(entry->artist == artist)
+			{
+				*slot = entry->next;
+				gsfs_artist_index.num_entries--;
+				entry->next = removed;
+				removed = entry;
+			}
+			else
+				slot = &(entry->next);
+		}
+	}
+	pthread_rwlock_unlock(&gsfs_names_lock);
+
+	return removed;
+}
+
+void gsfs_name_index_restore(GSFS_Name_Entry *removed)
+{
+	pthread_rwlock_wrlock(&gsfs_names_lock);
+	while(removed != NULL)
+	{
+		GSFS_Name_Entry *entry = removed;
+		removed = entry->next;
+
+		size_t bucket = gsfs_name_hash(entry->key) % gsfs_artist_index.num_buckets;
+		entry->next = gsfs_artist_index.buckets[bucket];
+		gsfs_artist_index.buckets[bucket] = entry;
+		gsfs_artist_index.num_entries++;
+	}
+	pthread_rwlock_unlock(&gsfs_names_lock);
+}
+
+void gsfs_name_index_free(GSFS_Name_Entry *removed)
+{
+	while(removed != NULL)
+	{
+		GSFS_Name_Entry *next = removed->next;
+		free(removed->key);
+		free(removed);
+		removed = next;
+	}
+}
+
+// Remember that grooveshark has no artist by this name
+void gsfs_name_reject(const char *name)
+{
+	char key[MAX_PATH];
+
+	gsfs_normalize_name(name, key);
+
+	pthread_rwlock_wrlock(&gsfs_names_lock);
+	gsfs_name_table_put(&gsfs_negative_cache, key, NULL);
+	pthread_rwlock_unlock(&gsfs_names_lock);
+}
+
+typedef enum {
+	NAME_REGISTERED, // an artist is already registered under this name
+	NAME_REJECTED,   // grooveshark recently said there's no such artist
+	NAME_UNKNOWN     // we'll have to ask grooveshark
+} GSFS_Name_Resolution;
+
+// Work out, locally, what registering an artist under this name would
+// do. canonical receives the name the artist is registered under, if it
+// is.
+GSFS_Name_Resolution gsfs_resolve_artist_name(
+	const char *name,
+	char canonical[MAX_PATH])
+{
+	char key[MAX_PATH];
+	GSFS_Name_Resolution resolution = NAME_UNKNOWN;
+
+	gsfs_normalize_name(name, key);
+	strncpy(canonical, name, MAX_PATH - 1);
+	canonical[MAX_PATH - 1] = '\0';
+
+	pthread_rwlock_wrlock(&gsfs_names_lock);
+
+	GSFS_Name_Entry **entry = gsfs_name_table_find(&gsfs_artist_index, key);
+	if(entry != NULL && *entry != NULL)
+	{
+		strncpy(canonical, (*entry)->artist->name, MAX_PATH - 1);
+		resolution = NAME_REGISTERED;
+	}
+	else if((entry = gsfs_name_table_find(&gsfs_negative_cache, key)) != NULL
+		&& *entry != NULL)
+	{
+		// rejections don't last forever; the catalog changes
+		if(time(NULL) - (*entry)->added < GSFS_NEGATIVE_TTL)
+			resolution = NAME_REJECTED;
+		else
+			gsfs_name_table_unlink(&gsfs_negative_cache, entry);
+	}
+
+	pthread_rwlock_unlock(&gsfs_names_lock);
+	return resolution;
+}
+
+// Find the name grooveshark knows that this one is a near miss of.
+// Only worth asking once grooveshark has turned the name down as it
+// was given; plenty of real artists are a letter away from each other.
+int gsfs_name_correct(const char *name, char canonical[MAX_PATH])
+{
+	char key[MAX_PATH];
+	GSFS_BK_Node *best = NULL;
+	int best_distance = MAX_PATH;
+
+	gsfs_normalize_name(name, key);
+
+	pthread_rwlock_rdlock(&gsfs_names_lock);
+	gsfs_bk_search(gsfs_known_artists, key, gsfs_name_tolerance(key), &best, &best_distance);
+	if(best != NULL)
+	{
+		strncpy(canonical, best->name, MAX_PATH - 1);
+		canonical[MAX_PATH - 1] = '\0';
+	}
+	pthread_rwlock_unlock(&gsfs_names_lock);
+
+	return best != NULL;
+}
@@ -0,0 +1,413 @@
+/*
+  Background job scheduler.
+
+  Everything gsfs does off the FUSE threads -- fetching chunks for a
+  read, reading ahead, prefetching the next songs, registering artists --
+  runs as a job on a shared pool of GSFS_SCHED_THREADS workers. Each job
+  has a priority class, and workers always look for work in the most
+  urgent class first:
+
+    GSFS_PRIO_READ          chunks a FUSE read is waiting on
+    GSFS_PRIO_READAHEAD     chunks just past what a stream has read
+    GSFS_PRIO_TRANSCODE     variants somebody has opened (gsfs_transcode.c)
+    GSFS_PRIO_PREFETCH      the start of the next songs on an album
+    GSFS_PRIO_REGISTRATION  catalog population
+
+  Each class also has a cap on how many workers may be running its jobs
+  at once, so slow registrations can never occupy the whole pool. The
+  background classes' caps add up to less than the pool, and whatever
+  they're set to, background jobs together never take the last worker:
+  there's always one left for a read.
+
+  Jobs that want to wait, to stay under a rate limit or for room in the
+  cache, are queued with a delay (gsfs_sched_submit_after()) rather than
+  sleeping on a worker.
+
+  Every worker has its own deque per class. Jobs submitted from a worker
+  go on that worker's deque and are popped LIFO; idle workers steal from
+  the other end of somebody else's.
+
+  Jobs may belong to a GSFS_Job_Group. Cancelling the group (gsfs_release
+  does this for a file handle's jobs) makes queued jobs run with
+  cancelled set, so they can clean up without doing any work.
+*/
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define GSFS_SCHED_THREADS 8
+
+typedef enum {
+	GSFS_PRIO_READ,
+	GSFS_PRIO_READAHEAD,
+	GSFS_PRIO_TRANSCODE,
+	GSFS_PRIO_PREFETCH,
+	GSFS_PRIO_REGISTRATION,
+	GSFS_NUM_PRIOS
+} GSFS_Priority;
+
+// How many workers may run jobs of each class at the same time
+atomic_int gsfs_sched_cap[GSFS_NUM_PRIOS] = {
+	GSFS_SCHED_THREADS, // reads may use every worker
+	3,
+	2,
+	1,
+	1
+};
+
+typedef struct {
+	atomic_int cancelled;
+	atomic_int refs;
+} GSFS_Job_Group;
+
+typedef void (*gsfs_job_fn)(void *arg, int cancelled);
+
+typedef struct GSFS_Job {
+	gsfs_job_fn fn;
+	void *arg;
+	GSFS_Job_Group *group;
+	GSFS_Priority prio;
+	struct timespec due;    // for delayed jobs
+	struct GSFS_Job *prev;
+	struct GSFS_Job *next;
+} GSFS_Job;
+
+// A doubly linked deque: the owner pushes and pops at the tail,
+// thieves take from the head
+typedef struct {
+	pthread_mutex_t lock;
+	GSFS_Job *head;
+	GSFS_Job *tail;
+} GSFS_Deque;
+
+typedef struct {
+	GSFS_Deque deques[GSFS_NUM_PRIOS];
+} GSFS_Worker;
+
+static GSFS_Worker gsfs_workers[GSFS_SCHED_THREADS];
+static atomic_int  gsfs_sched_running[GSFS_NUM_PRIOS];
+static atomic_int  gsfs_sched_background = 0; // running jobs that aren't reads
+static atomic_uint gsfs_sched_next_worker = 0;
+
+// Idle workers sleep here until something changes that might give them
+// a job to run: one is queued, one comes due or a running one finishes
+// and gives back its slot. Each of those counts an event, and a worker
+// only goes to sleep if none have happened since it last looked.
+static pthread_mutex_t gsfs_sched_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  gsfs_sched_cond = PTHREAD_COND_INITIALIZER;
+static int gsfs_sched_queued = 0;
+static unsigned long gsfs_sched_events = 0;
+
+// Delayed jobs, soonest due first, until they're moved to a deque.
+// Guarded by gsfs_sched_lock.
+static GSFS_Job *gsfs_sched_delayed = NULL;
+
+static pthread_once_t gsfs_sched_once = PTHREAD_ONCE_INIT;
+static __thread int gsfs_worker_id = -1;
+
+GSFS_Job_Group *gsfs_job_group_new(void)
+{
+	GSFS_Job_Group *group = calloc(1, sizeof(GSFS_Job_Group));
+	if(group != NULL)
+		atomic_init(&group->refs, 1);
+	return group;
+}
+
+static void gsfs_job_group_put(GSFS_Job_Group *group)
+{
+	if(group != NULL && atomic_fetch_sub(&group->refs, 1) == 1)
+		free(group);
+}
+
+// Cancel every job in the group that hasn't started yet, and give up
+// the caller's reference to it
+void gsfs_job_group_cancel(GSFS_Job_Group *group)
+{
+	if(group == NULL)
+		return;
+	atomic_store(&group->cancelled, 1);
+	gsfs_job_group_put(group);
+}
+
+static void gsfs_deque_push(GSFS_Deque *deque, GSFS_Job *job)
+{
+	pthread_mutex_lock(&deque->lock);
+	job->next = NULL;
+	job->prev = deque->tail;
+	if(deque->tail != NULL)
+		deque->tail->next = job;
+	else
+		deque->head = job;
+	deque->tail = job;
+	pthread_mutex_unlock(&deque->lock);
+}
+
+static GSFS_Job *gsfs_deque_pop(GSFS_Deque *deque, int steal)
+{
+	GSFS_Job *job;
+
+	pthread_mutex_lock(&deque->lock);
+	job = steal ? deque->head : deque->tail;
+	if(job != NULL)
+	{
+		if(job->prev != NULL)
+			job->prev->next = job->next;
+		else
+			deque->head = job->next;
+		if(job->next != NULL)
+			job->next->prev = job->prev;
+		else
+			deque->tail = job->prev;
+	}
+	pthread_mutex_unlock(&deque->lock);
+	return job;
+}
+
+static void gsfs_sched_release(int prio)
+{
+	if(prio != GSFS_PRIO_READ)
+		atomic_fetch_sub(&gsfs_sched_background, 1);
+	atomic_fetch_sub(&gsfs_sched_running[prio], 1);
+}
+
+// Claim one of the class's running slots; 0 if it's at its cap, or if
+// it's a background class and only one worker is left
+static int gsfs_sched_claim(int prio)
+{
+	int running = atomic_load(&gsfs_sched_running[prio]);
+	while(running < atomic_load(&gsfs_sched_cap[prio]))
+	{
+		if(atomic_compare_exchange_weak(&gsfs_sched_running[prio], &running, running + 1))
+		{
+			if(prio == GSFS_PRIO_READ
+				|| atomic_fetch_add(&gsfs_sched_background, 1) < GSFS_SCHED_THREADS - 1)
+				return 1;
+			gsfs_sched_release(prio);
+			return 0;
+		}
+	}
+	return 0;
+}
+
+// Find the most urgent job this worker is allowed to run: our own
+// newest job first, then the oldest job of any other worker
+static GSFS_Job *gsfs_sched_find(int self, int *prio_out)
+{
+	for(int prio = 0; prio < GSFS_NUM_PRIOS; prio++)
+	{
+		if(!gsfs_sched_claim(prio))
+			continue;
+
+		GSFS_Job *job = gsfs_deque_pop(&gsfs_workers[self].deques[prio], 0);
+		for(int i = 1; job == NULL && i < GSFS_SCHED_THREADS; i++)
+		{
+			int victim = (self + i) % GSFS_SCHED_THREADS;
+			job = gsfs_deque_pop(&gsfs_workers[victim].deques[prio], 1);
+		}
+
+		if(job != NULL)
+		{
+			*prio_out = prio;
+			return job;
+		}
+		gsfs_sched_release(prio);
+	}
+	return NULL;
+}
+
+static int gsfs_timespec_before(const struct timespec *a, const struct timespec *b)
+{
+	return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+// Move delayed jobs that have come due onto this worker's deques. Called
+// with gsfs_sched_lock held.
+static void gsfs_sched_release_due(int self)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	while(gsfs_sched_delayed != NULL && !gsfs_timespec_before(&now, &gsfs_sched_delayed->due))
+	{
+		GSFS_Job *job = gsfs_sched_delayed;
+		gsfs_sched_delayed = job->next;
+		gsfs_deque_push(&gsfs_workers[self].deques[job->prio], job);
+		gsfs_sched_queued++;
+		// we'll take one; another worker may be free for the rest
+		gsfs_sched_events++;
+		pthread_cond_signal(&gsfs_sched_cond);
+	}
+}
+
+static void *gsfs_sched_thread(void *arg)
+{
+	int self = (int) (long) arg;
+	gsfs_worker_id = self;
+
+	for(;;)
+	{
+		pthread_mutex_lock(&gsfs_sched_lock);
+		if(gsfs_sched_delayed != NULL)
+			gsfs_sched_release_due(self);
+		unsigned long seen = gsfs_sched_events;
+		pthread_mutex_unlock(&gsfs_sched_lock);
+
+		int prio;
+		GSFS_Job *job = gsfs_sched_find(self, &prio);
+
+		if(job == NULL)
+		{
+			// nothing we can run, whether there's nothing queued or
+			// what is queued is at its cap; sleep until that changes
+			// or a delayed job comes due
+			pthread_mutex_lock(&gsfs_sched_lock);
+			while(gsfs_sched_events == seen)
+			{
+				if(gsfs_sched_delayed == NULL)
+				{
+					pthread_cond_wait(&gsfs_sched_cond, &gsfs_sched_lock);
+					continue;
+				}
+				// a copy: the job may be run and freed while we wait
+				struct timespec due = gsfs_sched_delayed->due;
+				if(pthread_cond_timedwait(&gsfs_sched_cond, &gsfs_sched_lock, &due) == ETIMEDOUT)
+					break;
+			}
+			pthread_mutex_unlock(&gsfs_sched_lock);
+			continue;
+		}
+
+		pthread_mutex_lock(&gsfs_sched_lock);
+		gsfs_sched_queued--;
+		pthread_mutex_unlock(&gsfs_sched_lock);
+
+		int cancelled = job->group != NULL && atomic_load(&job->group->cancelled);
+		job->fn(job->arg, cancelled);
+
+		gsfs_job_group_put(job->group);
+		free(job);
+
+		gsfs_sched_release(prio);
+
+		// a slot opened up; somebody may have been waiting for it
+		pthread_mutex_lock(&gsfs_sched_lock);
+		gsfs_sched_events++;
+		if(gsfs_sched_queued > 0)
+			pthread_cond_signal(&gsfs_sched_cond);
+		pthread_mutex_unlock(&gsfs_sched_lock);
+	}
+	return NULL;
+}
+
+static void gsfs_sched_start(void)
+{
+	for(int i = 0; i < GSFS_SCHED_THREADS; i++)
+		for(int prio = 0; prio < GSFS_NUM_PRIOS; prio++)
+			pthread_mutex_init(&gsfs_workers[i].deques[prio].lock, NULL);
+
+	for(long i = 0; i < GSFS_SCHED_THREADS; i++)
+	{
+		pthread_t thread;
+		if(pthread_create(&thread, NULL, gsfs_sched_thread, (void *) i) == 0)
+			pthread_detach(thread);
+	}
+}
+
+static GSFS_Job *gsfs_job_new(
+	GSFS_Priority prio,
+	GSFS_Job_Group *group,
+	gsfs_job_fn fn,
+	void *arg)
+{
+	pthread_once(&gsfs_sched_once, gsfs_sched_start);
+
+	GSFS_Job *job = calloc(1, sizeof(GSFS_Job));
+	if(job == NULL)
+		return NULL;
+	job->fn = fn;
+	job->arg = arg;
+	job->prio = prio;
+	job->group = group;
+	if(group != NULL)
+		atomic_fetch_add(&group->refs, 1);
+	return job;
+}
+
+// Queue fn(arg) to run at the given priority. If the job can't even be
+// queued, it is run right away as cancelled so it can clean up.
+void gsfs_sched_submit(
+	GSFS_Priority prio,
+	GSFS_Job_Group *group,
+	gsfs_job_fn fn,
+	void *arg)
+{
+	GSFS_Job *job = gsfs_job_new(prio, group, fn, arg);
+	if(job == NULL)
+	{
+		fn(arg, 1);
+		return;
+	}
+
+	// jobs spawned by a worker stay with it; everything else is spread
+	// round robin and left for stealing to balance out
+	int worker = gsfs_worker_id;
+	if(worker < 0)
+		worker = atomic_fetch_add(&gsfs_sched_next_worker, 1) % GSFS_SCHED_THREADS;
+	gsfs_deque_push(&gsfs_workers[worker].deques[prio], job);
+
+	pthread_mutex_lock(&gsfs_sched_lock);
+	gsfs_sched_queued++;
+	gsfs_sched_events++;
+	pthread_cond_signal(&gsfs_sched_cond);
+	pthread_mutex_unlock(&gsfs_sched_lock);
+}
+
+// Queue fn(arg) to run at the given priority once delay_ms have passed.
+// Nothing holds a worker in the meantime. A cancelled group doesn't cut
+// the wait short; the job still runs, as cancelled, when it comes due.
+void gsfs_sched_submit_after(
+	GSFS_Priority prio,
+	GSFS_Job_Group *group,
+	gsfs_job_fn fn,
+	void *arg,
+	long delay_ms)
+{
+	if(delay_ms <= 0)
+	{
+		gsfs_sched_submit(prio, group, fn, arg);
+		return;
+	}
+
+	GSFS_Job *job = gsfs_job_new(prio, group, fn, arg);
+	if(job == NULL)
+	{
+		fn(arg, 1);
+		return;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &job->due);
+	job->due.tv_sec += delay_ms / 1000;
+	job->due.tv_nsec += (delay_ms % 1000) * 1000000;
+	if(job->due.tv_nsec >= 1000000000)
+	{
+		job->due.tv_sec++;
+		job->due.tv_nsec -= 1000000000;
+	}
+
+	pthread_mutex_lock(&gsfs_sched_lock);
+	GSFS_Job **slot = &gsfs_sched_delayed;
+	while(*slot != NULL && !gsfs_timespec_before(&job->due, &(*slot)->due))
+		slot = &((*slot)->next);
+	job->next = *slot;
+	*slot = job;
+	// a worker asleep may need to wake up sooner than it planned to
+	if(slot == &gsfs_sched_delayed)
+	{
+		gsfs_sched_events++;
+		pthread_cond_signal(&gsfs_sched_cond);
+	}
+	pthread_mutex_unlock(&gsfs_sched_lock);
+}
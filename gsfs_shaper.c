@@ -0,0 +1,355 @@
+/*
+  Bandwidth shaping across streams.
+
+  Reads always fetch what they need straight away, but readahead for an
+  open song goes through here, so that one stream reading far ahead can't
+  take the whole uplink while another is about to run dry. Every open
+  song is a GSFS_Stream with a queue of chunks it would like read ahead,
+  and a dispatcher thread hands those chunks to the scheduler in deficit
+  round robin: every round, each stream with something queued earns a
+  quantum of bytes it may fetch, and streams are visited neediest first,
+  that is, in order of how many milliseconds of audio they have buffered
+  ahead of the listener.
+
+  gsfs_bandwidth_limit caps all fetching (reads included) and
+  gsfs_stream_rate_limit caps readahead for each stream, both in bytes
+  per second; 0 means no limit. A chunk may be dispatched whenever a
+  bucket has any tokens left, and the balance goes negative by what it
+  cost, so limits under a chunk a second still get chunks out, just
+  less often.
+
+  Each stream counts its stalls (sequential reads that had to wait for
+  audio), and they are logged when the stream is closed.
+*/
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define GSFS_SHAPER_QUANTUM GSFS_CHUNK_SIZE
+
+atomic_size_t gsfs_bandwidth_limit = 0;
+atomic_size_t gsfs_stream_rate_limit = 0;
+
+typedef struct GSFS_Stream_Request {
+	Song *song;
+	int   index;
+	struct GSFS_Stream_Request *next;
+} GSFS_Stream_Request;
+
+typedef struct GSFS_Stream {
+	GSFS_Job_Group *group;
+	GSFS_Stream_Request *head;
+	GSFS_Stream_Request *tail;
+	long   buffered_ms;   // audio ready ahead of the listener
+	size_t deficit;
+	double tokens;        // for gsfs_stream_rate_limit
+	int    stalls;
+	size_t read_ahead;    // bytes dispatched on the stream's behalf
+	struct GSFS_Stream *prev;
+	struct GSFS_Stream *next;
+} GSFS_Stream;
+
+// Guards every stream and the token buckets
+static pthread_mutex_t gsfs_shaper_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  gsfs_shaper_cond = PTHREAD_COND_INITIALIZER;
+static GSFS_Stream *gsfs_streams = NULL;
+static double gsfs_shaper_tokens = 0;
+static struct timespec gsfs_shaper_refilled;
+static pthread_once_t gsfs_shaper_once = PTHREAD_ONCE_INIT;
+
+// Top up the token buckets for the time since they were last topped up.
+// Buckets hold at most a second's worth, so idle streams can't save up
+// a burst. Called with gsfs_shaper_lock held.
+static void gsfs_shaper_refill(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	double elapsed = (now.tv_sec - gsfs_shaper_refilled.tv_sec)
+		+ (now.tv_nsec - gsfs_shaper_refilled.tv_nsec) / 1e9;
+	gsfs_shaper_refilled = now;
+
+	size_t limit = atomic_load(&gsfs_bandwidth_limit);
+	if(limit > 0)
+	{
+		gsfs_shaper_tokens += elapsed * limit;
+		if(gsfs_shaper_tokens > limit)
+			gsfs_shaper_tokens = limit;
+	}
+
+	size_t rate = atomic_load(&gsfs_stream_rate_limit);
+	if(rate > 0)
+	{
+		for(GSFS_Stream *stream = gsfs_streams; stream != NULL; stream = stream->next)
+		{
+			stream->tokens += elapsed * rate;
+			if(stream->tokens > rate)
+				stream->tokens = rate;
+		}
+	}
+}
+
+static int gsfs_shaper_global_ok(void)
+{
+	return gsfs_bandwidth_limit == 0 || gsfs_shaper_tokens > 0;
+}
+
+static int gsfs_stream_ok(GSFS_Stream *stream)
+{
+	return gsfs_stream_rate_limit == 0 || stream->tokens > 0;
+}
+
+// How many seconds until whatever is holding queued readahead back has
+// tokens again, or 0 if nothing is. Called with gsfs_shaper_lock held.
+static double gsfs_shaper_next_tokens(void)
+{
+	double wait = 0;
+	
+	size_t limit = atomic_load(&gsfs_bandwidth_limit);
+	if(limit > 0 && gsfs_shaper_tokens <= 0)
+		wait = (1 - gsfs_shaper_tokens) / limit;
+	
+	// the stream that gets tokens back first
+	size_t rate = atomic_load(&gsfs_stream_rate_limit);
+	double soonest = -1;
+	for(GSFS_Stream *stream = gsfs_streams; stream != NULL; stream = stream->next)
+	{
+		if(stream->head == NULL)
+			continue;
+		double next = rate > 0 && stream->tokens <= 0 ? (1 - stream->tokens) / rate : 0;
+		if(soonest < 0 || next < soonest)
+			soonest = next;
+	}
+	
+	return soonest > wait ? soonest : wait;
+}
+
+static int gsfs_stream_compare(const void *a, const void *b)
+{
+	long x = (*(GSFS_Stream **) a)->buffered_ms;
+	long y = (*(GSFS_Stream **) b)->buffered_ms;
+	return x < y ? -1 : x > y;
+}
+
+// A stream's turn in a round. Returns how many chunks it handed out.
+static int gsfs_shaper_serve(GSFS_Stream *stream)
+{
+	int dispatched = 0;
+	
+	if(!gsfs_stream_ok(stream))
+		return 0;
+
+	stream->deficit += GSFS_SHAPER_QUANTUM;
+	while(stream->head != NULL && stream->deficit >= GSFS_CHUNK_SIZE
+		&& gsfs_shaper_global_ok() && gsfs_stream_ok(stream))
+	{
+		GSFS_Stream_Request *request = stream->head;
+		stream->head = request->next;
+		if(stream->head == NULL)
+			stream->tail = NULL;
+
+		// already cached; costs nothing
+		if(gsfs_song_chunk_ready(request->song, request->index))
+		{
+			free(request);
+			continue;
+		}
+
+		stream->deficit -= GSFS_CHUNK_SIZE;
+		stream->read_ahead += GSFS_CHUNK_SIZE;
+		if(gsfs_stream_rate_limit > 0)
+			stream->tokens -= GSFS_CHUNK_SIZE;
+		if(gsfs_bandwidth_limit > 0)
+			gsfs_shaper_tokens -= GSFS_CHUNK_SIZE;
+		dispatched++;
+
+		// the stream's owner holds the song for as long as the
+		// stream exists, and the job takes its own reference
+		gsfs_get_song_audio_async(request->song, request->index,
+			GSFS_PRIO_READAHEAD, stream->group, NULL, NULL);
+		free(request);
+	}
+
+	// an idle stream doesn't get to bank its deficit
+	if(stream->head == NULL)
+		stream->deficit = 0;
+
+	return dispatched;
+}
+
+// One round of deficit round robin. Returns how many chunks it handed
+// out. Called with gsfs_shaper_lock held throughout, so no stream can be
+// freed in the middle of the round.
+static int gsfs_shaper_round(void)
+{
+	int num = 0;
+	int dispatched = 0;
+
+	for(GSFS_Stream *stream = gsfs_streams; stream != NULL; stream = stream->next)
+		num += stream->head != NULL;
+	if(num == 0)
+		return 0;
+
+	GSFS_Stream **round = malloc(num * sizeof(GSFS_Stream *));
+	if(round == NULL)
+	{
+		// no memory to sort them by need; everyone still gets a turn
+		for(GSFS_Stream *stream = gsfs_streams; stream != NULL && gsfs_shaper_global_ok(); stream = stream->next)
+			if(stream->head != NULL)
+				dispatched += gsfs_shaper_serve(stream);
+		return dispatched;
+	}
+
+	num = 0;
+	for(GSFS_Stream *stream = gsfs_streams; stream != NULL; stream = stream->next)
+		if(stream->head != NULL)
+			round[num++] = stream;
+	qsort(round, num, sizeof(GSFS_Stream *), gsfs_stream_compare);
+
+	for(int i = 0; i < num && gsfs_shaper_global_ok(); i++)
+		dispatched += gsfs_shaper_serve(round[i]);
+
+	free(round);
+	return dispatched;
+}
+
+static void *gsfs_shaper_thread(void *arg)
+{
+	pthread_mutex_lock(&gsfs_shaper_lock);
+	for(;;)
+	{
+		gsfs_shaper_refill();
+		if(gsfs_shaper_round() > 0)
+			continue;
+
+		int queued = 0;
+		for(GSFS_Stream *stream = gsfs_streams; stream != NULL; stream = stream->next)
+			queued |= stream->head != NULL;
+
+		if(!queued)
+			pthread_cond_wait(&gsfs_shaper_cond, &gsfs_shaper_lock);
+		else
+		{
+			// out of tokens; sleep till the first of them are back, but
+			// look again at least every second in case a limit changed
+			double wait = gsfs_shaper_next_tokens();
+			if(wait > 1)
+				wait = 1;
+			struct timespec timeout;
+			clock_gettime(CLOCK_REALTIME, &timeout);
+			long nsec = (long) (wait * 1e9);
+			timeout.tv_sec += nsec / 1000000000;
+			timeout.tv_nsec += nsec % 1000000000;
+			if(timeout.tv_nsec >= 1000000000)
+			{
+				timeout.tv_sec++;
+				timeout.tv_nsec -= 1000000000;
+			}
+			pthread_cond_timedwait(&gsfs_shaper_cond, &gsfs_shaper_lock, &timeout);
+		}
+	}
+	return NULL;
+}
+
+static void gsfs_shaper_start(void)
+{
+	pthread_t thread;
+	clock_gettime(CLOCK_MONOTONIC, &gsfs_shaper_refilled);
+	if(pthread_create(&thread, NULL, gsfs_shaper_thread, NULL) == 0)
+		pthread_detach(thread);
+}
+
+// A new stream, whose readahead runs as part of group
+GSFS_Stream *gsfs_stream_new(GSFS_Job_Group *group)
+{
+	pthread_once(&gsfs_shaper_once, gsfs_shaper_start);
+
+	GSFS_Stream *stream = calloc(1, sizeof(GSFS_Stream));
+	if(stream == NULL)
+		return NULL;
+	stream->group = group;
+	stream->tokens = gsfs_stream_rate_limit;
+
+	pthread_mutex_lock(&gsfs_shaper_lock);
+	stream->next = gsfs_streams;
+	if(gsfs_streams != NULL)
+		gsfs_streams->prev = stream;
+	gsfs_streams = stream;
+	pthread_mutex_unlock(&gsfs_shaper_lock);
+
+	return stream;
+}
+
+// Drop everything the stream still has queued and forget it
+void gsfs_stream_free(GSFS_Stream *stream, const char *path)
+{
+	if(stream == NULL)
+		return;
+
+	pthread_mutex_lock(&gsfs_shaper_lock);
+	if(stream->prev != NULL)
+		stream->prev->next = stream->next;
+	else
+		gsfs_streams = stream->next;
+	if(stream->next != NULL)
+		stream->next->prev = stream->prev;
+	pthread_mutex_unlock(&gsfs_shaper_lock);
+
+	while(stream->head != NULL)
+	{
+		GSFS_Stream_Request *request = stream->head;
+		stream->head = request->next;
+		free(request);
+	}
+
+	log_msg("    stream \"%s\": %d stalls, %zu bytes read ahead\n",
+		path, stream->stalls, stream->read_ahead);
+	free(stream);
+}
+
+// Ask for a chunk to be read ahead when the stream's turn comes
+void gsfs_stream_readahead(GSFS_Stream *stream, Song *song, int index)
+{
+	GSFS_Stream_Request *request = calloc(1, sizeof(GSFS_Stream_Request));
+	if(request == NULL)
+		return;
+	request->song = song;
+	request->index = index;
+
+	pthread_mutex_lock(&gsfs_shaper_lock);
+	if(stream->tail != NULL)
+		stream->tail->next = request;
+	else
+		stream->head = request;
+	stream->tail = request;
+	pthread_cond_signal(&gsfs_shaper_cond);
+	pthread_mutex_unlock(&gsfs_shaper_lock);
+}
+
+// Tell the shaper how far ahead of the listener the stream is buffered
+void gsfs_stream_buffered(GSFS_Stream *stream, long buffered_ms)
+{
+	pthread_mutex_lock(&gsfs_shaper_lock);
+	stream->buffered_ms = buffered_ms;
+	pthread_mutex_unlock(&gsfs_shaper_lock);
+}
+
+// The listener caught up with the stream's buffer and had to wait
+void gsfs_stream_stall(GSFS_Stream *stream)
+{
+	pthread_mutex_lock(&gsfs_shaper_lock);
+	stream->stalls++;
+	pthread_mutex_unlock(&gsfs_shaper_lock);
+}
+
+// A read fetched size bytes outside the shaper; it still counts against
+// the global limit, so readahead backs off to make room for it
+void gsfs_shaper_charge(size_t size)
+{
+	if(gsfs_bandwidth_limit == 0)
+		return;
+	pthread_mutex_lock(&gsfs_shaper_lock);
+	gsfs_shaper_tokens -= size;
+	pthread_mutex_unlock(&gsfs_shaper_lock);
+}
@@ -0,0 +1,559 @@
+/*
+  Soak test.
+
+  Built with GSFS_SOAK, gsfs doesn't mount anything: main() hands the
+  FUSE callbacks to gsfs_soak(), which registers artists and has
+  listener threads open, read and close songs through them for as long
+  as it's told to. Built with the stub backend too (see gsfs_stub.c),
+  everything read is checked against what the stub served:
+
+    a song is as long as its tag and its audio together
+    every read returns exactly as many bytes as it asked for, or as are
+    left, and past the tag they're the song's own, byte for byte
+    reads at or past the end return nothing
+    songs whose ID3 tag runs past the first chunk still get a bitrate
+    from their first frame, once they've been read
+    an artist whose registration failed is nowhere to be found, not even
+    in part
+
+  Every interval it logs read latency (50th, 99th and 99.9th percentile),
+  the resident set size and the audio cache's hit ratio; every stream
+  logs its own stalls when it's closed. At the end it also fails if the
+  resident set grew more than max_growth_mb past where it stood after
+  the first interval, or the 99.9th percentile over the whole run came
+  out above max_p999_ms, and exits non-zero if anything failed.
+
+  It's set up from the GSFS_SOAK environment variable, a comma separated
+  list of name=value pairs:
+
+    duration_s=10800   how long to run (600 by default)
+    interval_s=60      how often to report
+    listeners=16       threads reading songs
+    artists=32         stub artists to register
+    max_growth_mb=32
+    max_p999_ms=2000
+    seed=1
+
+  Any other name is a knob, written to /.gsfs/name before the listeners
+  start: cache_size=67108864,stream_rate_limit=65536 soaks a small cache
+  under a tight per-stream limit.
+
+  Listeners pick songs from a skewed sequence that's the same every run
+  (for the same seed), so a second run over the same rootdir replays the
+  first's trace against the access log it left behind: the hit ratio it
+  reports over its first hour is the warm start's. GSFS_IO=threads runs
+  the disk cache's writes on threads rather than io_uring, to compare the
+  two over the same trace. Fault injection (see gsfs_fault.c) can be
+  built in as well; reads cut short are only counted then, not failed.
+
+  gcc -DGSFS_SOAK -DGSFS_STUB_BACKEND ... gsfs_soak.c gsfs_stub.c
+  GSFS_SOAK=duration_s=10800,listeners=32 ./gsfs rootdir unused
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#ifdef GSFS_SOAK
+
+#define GSFS_SOAK_READ (128 * 1024)   // what the kernel reads in at a time
+#define GSFS_SOAK_MAX_LISTENERS 1024
+#define GSFS_SOAK_MAX_FAILURES_LOGGED 100
+
+// Read latencies, in nanoseconds, by their top four bits: eight buckets
+// to every power of two, so a percentile is good to an eighth
+#define GSFS_SOAK_BUCKETS (64 * 8)
+
+typedef struct {
+	atomic_long counts[GSFS_SOAK_BUCKETS];
+} GSFS_Soak_Latency;
+
+static long gsfs_soak_duration_s = 600;
+static long gsfs_soak_interval_s = 60;
+static int  gsfs_soak_listeners = 16;
+static int  gsfs_soak_artists = 32;
+static long gsfs_soak_max_growth_mb = 32;
+static long gsfs_soak_max_p999_ms = 2000;
+static unsigned long gsfs_soak_seed = 1;
+
+static struct fuse_operations *gsfs_soak_oper;
+static atomic_int  gsfs_soak_running;
+static atomic_long gsfs_soak_failures;
+static atomic_long gsfs_soak_reads;
+static atomic_long gsfs_soak_short_reads;
+static atomic_long gsfs_soak_songs;
+static int gsfs_soak_unreachable = 0;
+static GSFS_Soak_Latency gsfs_soak_interval_latency;
+static GSFS_Soak_Latency gsfs_soak_total_latency;
+
+static void gsfs_soak_fail(const char *format, ...)
+{
+	if(atomic_fetch_add(&gsfs_soak_failures, 1) >= GSFS_SOAK_MAX_FAILURES_LOGGED)
+		return;
+	char message[512];
+	va_list args;
+	va_start(args, format);
+	vsnprintf(message, sizeof(message), format, args);
+	va_end(args);
+	log_msg("    soak: FAILED %s\n", message);
+}
+
+static int gsfs_soak_bucket(long ns)
+{
+	if(ns < 8)
+		return ns < 0 ? 0 : ns;
+	int top = 63 - __builtin_clzl(ns);
+	return top * 8 + ((ns >> (top - 3)) & 7);
+}
+
+// The least latency that lands in the bucket
+static double gsfs_soak_bucket_ms(int bucket)
+{
+	if(bucket < 8)
+		return bucket / 1e6;
+	int top = bucket / 8;
+	return (double) ((8L + bucket % 8) << (top - 3)) / 1e6;
+}
+
+static void gsfs_soak_count_latency(long ns)
+{
+	int bucket = gsfs_soak_bucket(ns);
+	atomic_fetch_add_explicit(&gsfs_soak_interval_latency.counts[bucket], 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&gsfs_soak_total_latency.counts[bucket], 1, memory_order_relaxed);
+}
+
+// The 50th, 99th and 99.9th percentiles, in ms, of what's been counted;
+// with clear set the counts are taken out as they're read
+static long gsfs_soak_percentiles(GSFS_Soak_Latency *latency, int clear, double ms[3])
+{
+	static const double wanted[3] = { 0.5, 0.99, 0.999 };
+	long counts[GSFS_SOAK_BUCKETS];
+	long total = 0;
+
+	for(int i = 0; i < GSFS_SOAK_BUCKETS; i++)
+	{
+		counts[i] = clear ? atomic_exchange(&latency->counts[i], 0)
+			: atomic_load(&latency->counts[i]);
+		total += counts[i];
+	}
+
+	for(int p = 0; p < 3; p++)
+	{
+		long seen = 0;
+		int i = 0;
+		while(i < GSFS_SOAK_BUCKETS - 1 && seen + counts[i] < wanted[p] * total)
+			seen += counts[i++];
+		ms[p] = total == 0 ? 0 : gsfs_soak_bucket_ms(i);
+	}
+	return total;
+}
+
+static double gsfs_soak_elapsed_ms(struct timespec *since)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - since->tv_sec) * 1000.0
+		+ (now.tv_nsec - since->tv_nsec) / 1000000.0;
+}
+
+// Resident set size, in bytes
+static size_t gsfs_soak_rss(void)
+{
+	long pages = 0;
+	FILE *statm = fopen("/proc/self/statm", "r");
+	if(statm == NULL)
+		return 0;
+	if(fscanf(statm, "%*s %ld", &pages) != 1)
+		pages = 0;
+	fclose(statm);
+	return (size_t) pages * sysconf(_SC_PAGESIZE);
+}
+
+// A cheap per-listener xorshift, as gsfs_fault.c has
+static double gsfs_soak_random(unsigned long *state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return (*state >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Write value to the knob called name
+static int gsfs_soak_knob(const char *name, const char *value)
+{
+	char path[MAX_PATH];
+	snprintf(path, MAX_PATH, "/.gsfs/%s", name);
+
+	struct fuse_file_info fi;
+	memset(&fi, 0, sizeof(fi));
+	fi.flags = O_WRONLY;
+	int error = gsfs_soak_oper->open(path, &fi);
+	if(error != SUCCESS)
+		return error;
+	int written = gsfs_soak_oper->write(path, value, strlen(value), 0, &fi);
+	gsfs_soak_oper->release(path, &fi);
+	return written == strlen(value) ? SUCCESS : EINVAL;
+}
+
+static void gsfs_soak_configure(void)
+{
+	const char *spec = getenv("GSFS_SOAK");
+	if(spec == NULL)
+		spec = "";
+
+	char name[32], value[64];
+	int used;
+	while(sscanf(spec, " %31[^=]=%63[^,]%n", name, value, &used) == 2)
+	{
+		if(strcmp(name, "duration_s") == 0)
+			gsfs_soak_duration_s = atol(value);
+		else if(strcmp(name, "interval_s") == 0)
+			gsfs_soak_interval_s = atol(value);
+		else if(strcmp(name, "listeners") == 0)
+			gsfs_soak_listeners = atoi(value);
+		else if(strcmp(name, "artists") == 0)
+			gsfs_soak_artists = atoi(value);
+		else if(strcmp(name, "max_growth_mb") == 0)
+			gsfs_soak_max_growth_mb = atol(value);
+		else if(strcmp(name, "max_p999_ms") == 0)
+			gsfs_soak_max_p999_ms = atol(value);
+		else if(strcmp(name, "seed") == 0)
+			gsfs_soak_seed = strtoul(value, NULL, 10);
+		else if(gsfs_soak_knob(name, value) != SUCCESS)
+			gsfs_soak_fail("setting %s to %s", name, value);
+		spec += used;
+		if(*spec != ',')
+			break;
+		spec++;
+	}
+
+	if(gsfs_soak_interval_s <= 0)
+		gsfs_soak_interval_s = 60;
+	if(gsfs_soak_listeners < 1)
+		gsfs_soak_listeners = 1;
+	if(gsfs_soak_listeners > GSFS_SOAK_MAX_LISTENERS)
+		gsfs_soak_listeners = GSFS_SOAK_MAX_LISTENERS;
+	if(gsfs_soak_artists < 1)
+		gsfs_soak_artists = 1;
+	if(gsfs_soak_seed == 0)
+		gsfs_soak_seed = 1;
+
+	const char *io = getenv("GSFS_IO");
+	log_msg("    soak: %ld s, reporting every %ld s, %d listeners over %d artists, seed %lu, disk cache I/O on %s\n",
+		gsfs_soak_duration_s, gsfs_soak_interval_s, gsfs_soak_listeners,
+		gsfs_soak_artists, gsfs_soak_seed,
+		io != NULL && strcmp(io, "threads") == 0 ? "threads" : "io_uring");
+}
+
+typedef struct {
+	const char *name;
+	int found;
+} GSFS_Soak_Listing;
+
+static int gsfs_soak_filler(void *buf, const char *name, const struct stat *st, off_t offset)
+{
+	GSFS_Soak_Listing *listing = buf;
+	if(strcmp(name, listing->name) == 0)
+		listing->found = 1;
+	return 0;
+}
+
+// Is name listed in the directory at path?
+static int gsfs_soak_listed(const char *path, const char *name)
+{
+	GSFS_Soak_Listing listing = { name, 0 };
+	struct fuse_file_info fi;
+	memset(&fi, 0, sizeof(fi));
+	if(gsfs_soak_oper->opendir(path, &fi) != SUCCESS)
+		return 0;
+	gsfs_soak_oper->readdir(path, &listing, gsfs_soak_filler, 0, &fi);
+	gsfs_soak_oper->releasedir(path, &fi);
+	return listing.found;
+}
+
+// Register an artist whose albums can't be fetched, and make sure none
+// of it was left behind
+static void gsfs_soak_register_unreachable(void)
+{
+	char name[MAX_PATH], path[MAX_PATH];
+	snprintf(name, MAX_PATH, "Unreachable %d", gsfs_soak_unreachable++);
+	snprintf(path, MAX_PATH, "/%s", name);
+
+	struct stat st;
+	if(gsfs_soak_oper->mkdir(path, 0755) == SUCCESS)
+		gsfs_soak_fail("mkdir \"%s\" succeeded", path);
+	if(gsfs_soak_oper->getattr(path, &st) != ENOENT)
+		gsfs_soak_fail("\"%s\" is there after its registration failed", path);
+	if(gsfs_soak_listed("/", name))
+		gsfs_soak_fail("\"%s\" is listed after its registration failed", path);
+}
+
+static void gsfs_soak_register(void)
+{
+	for(int artist = 0; artist < gsfs_soak_artists; artist++)
+	{
+		char path[MAX_PATH];
+		snprintf(path, MAX_PATH, "/Stub Artist %d", artist);
+		int error = gsfs_soak_oper->mkdir(path, 0755);
+		if(error != SUCCESS && error != EEXIST)
+			gsfs_soak_fail("mkdir \"%s\": %d", path, error);
+		else if(!gsfs_soak_listed("/", path + 1))
+			gsfs_soak_fail("\"%s\" isn't listed", path);
+	}
+	gsfs_soak_register_unreachable();
+}
+
+typedef struct {
+	const char *path;
+	struct fuse_file_info fi;
+	long   audio_id;
+	size_t tag_len;
+	size_t size;       // the tag and the audio
+	char * buf;
+	unsigned char *expected;
+} GSFS_Soak_Song;
+
+// Read size bytes at offset and check them. Returns how many came back.
+static size_t gsfs_soak_read(GSFS_Soak_Song *song, off_t offset, size_t size)
+{
+	size_t wanted = 0;
+	if(offset < song->size)
+		wanted = song->size - offset < size ? song->size - offset : size;
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	int len = gsfs_soak_oper->read(song->path, song->buf, size, offset, &song->fi);
+	gsfs_soak_count_latency((long) (gsfs_soak_elapsed_ms(&start) * 1e6));
+	atomic_fetch_add(&gsfs_soak_reads, 1);
+
+	if(len < 0 || len > wanted)
+	{
+		gsfs_soak_fail("read of \"%s\" at %lld for %zu gave %d, not %zu",
+			song->path, (long long) offset, size, len, wanted);
+		return 0;
+	}
+	if(len < wanted)
+	{
+		// only fault injection cuts reads short
+		atomic_fetch_add(&gsfs_soak_short_reads, 1);
+		if(getenv("GSFS_FAULTS") == NULL)
+			gsfs_soak_fail("read of \"%s\" at %lld for %zu gave %d, not %zu",
+				song->path, (long long) offset, size, len, wanted);
+	}
+
+	// the tag is built from the catalog; only its header is ours to know
+	for(off_t at = offset; at < offset + len && at < 3; at++)
+		if(song->buf[at - offset] != "ID3"[at])
+			gsfs_soak_fail("\"%s\" doesn't start with a tag", song->path);
+
+	// until the tag's header has been read, we don't know where it ends
+	off_t audio = offset > song->tag_len ? offset : song->tag_len;
+	if(song->tag_len > 0 && audio < offset + len)
+	{
+		size_t audio_len = offset + len - audio;
+		gsfs_stub_audio(song->audio_id, audio - song->tag_len, song->expected, audio_len);
+		if(memcmp(song->buf + (audio - offset), song->expected, audio_len) != 0)
+			gsfs_soak_fail("read of \"%s\" at %lld for %zu came back wrong",
+				song->path, (long long) offset, size);
+	}
+	return len;
+}
+
+// Listen to a song: usually from the start, sometimes all the way
+// through, sometimes skipping about
+static void gsfs_soak_listen(unsigned long *state, char *buf, unsigned char *expected)
+{
+	// the first artists, albums and tracks are the popular ones
+	double r = gsfs_soak_random(state);
+	int artist = (int) (r * r * r * gsfs_soak_artists);
+	int album = (int) (gsfs_soak_random(state) * gsfs_stub_num_albums(artist));
+	long album_id = gsfs_stub_album_id(artist, album);
+	r = gsfs_soak_random(state);
+	int track = (int) (r * r * gsfs_stub_num_songs(album_id));
+	long audio_id = gsfs_stub_audio_id(gsfs_stub_song_id(album_id, track));
+
+	char path[MAX_PATH];
+	snprintf(path, MAX_PATH, "/Stub Artist %d/Album %d/Track %02d.mp3",
+		artist, album + 1, track + 1);
+
+	GSFS_Soak_Song song;
+	memset(&song, 0, sizeof(song));
+	song.path = path;
+	song.audio_id = audio_id;
+	song.buf = buf;
+	song.expected = expected;
+	song.fi.flags = O_RDONLY;
+
+	struct stat st;
+	int error = gsfs_soak_oper->getattr(path, &st);
+	if(error != SUCCESS)
+	{
+		gsfs_soak_fail("getattr \"%s\": %d", path, error);
+		return;
+	}
+	error = gsfs_soak_oper->open(path, &song.fi);
+	if(error != SUCCESS)
+	{
+		gsfs_soak_fail("open \"%s\": %d", path, error);
+		return;
+	}
+	atomic_fetch_add(&gsfs_soak_songs, 1);
+
+	// how long our tag is comes from its header
+	song.size = st.st_size;
+	if(gsfs_soak_read(&song, 0, 10) == 10)
+	{
+		song.tag_len = gsfs_id3v2_length((unsigned char *) buf, 10);
+		if(song.tag_len + gsfs_stub_audio_size(audio_id) != st.st_size)
+			gsfs_soak_fail("\"%s\" is %lld bytes, not %zu", path, (long long) st.st_size,
+				song.tag_len + gsfs_stub_audio_size(audio_id));
+	}
+	if(song.tag_len == 0)
+	{
+		gsfs_soak_oper->release(path, &song.fi);
+		return;
+	}
+
+	if(gsfs_soak_random(state) < 0.1)
+	{
+		// skip about, reads of any size anywhere, even past the end
+		for(int i = 0; i < 8; i++)
+		{
+			off_t offset = (off_t) (gsfs_soak_random(state) * (song.size + GSFS_SOAK_READ));
+			size_t size = 1 + (size_t) (gsfs_soak_random(state) * (GSFS_SOAK_READ - 1));
+			gsfs_soak_read(&song, offset, size);
+		}
+	}
+	else
+	{
+		// play from the start; one in four listeners give up part way
+		off_t stop = song.size;
+		if(gsfs_soak_random(state) < 0.25)
+			stop = (off_t) (gsfs_soak_random(state) * song.size);
+
+		off_t offset = 0;
+		while(offset < stop && atomic_load(&gsfs_soak_running))
+		{
+			size_t len = gsfs_soak_read(&song, offset, GSFS_SOAK_READ);
+			if(len == 0)
+				break;
+			offset += len;
+		}
+
+		if(offset >= song.size)
+		{
+			if(gsfs_soak_read(&song, song.size, GSFS_SOAK_READ) != 0)
+				gsfs_soak_fail("read past the end of \"%s\"", path);
+
+			// a long tag hides the first frame from the first chunk, and
+			// the catalog has no duration to go by
+			if(gsfs_stub_tag_length(audio_id) > GSFS_CHUNK_SIZE)
+			{
+				char bitrate[16] = "";
+				int len = gsfs_soak_oper->getxattr(path, "user.bitrate", bitrate, sizeof(bitrate) - 1);
+				if(len != 3 || strncmp(bitrate, "128", 3) != 0)
+					gsfs_soak_fail("\"%s\" has no bitrate after being read through", path);
+			}
+		}
+	}
+
+	gsfs_soak_oper->release(path, &song.fi);
+}
+
+static void *gsfs_soak_listener(void *arg)
+{
+	unsigned long state = gsfs_soak_seed * 2654435761UL + (unsigned long) (intptr_t) arg;
+	char *buf = malloc(GSFS_SOAK_READ);
+	unsigned char *expected = malloc(GSFS_SOAK_READ);
+
+	if(buf == NULL || expected == NULL)
+		gsfs_soak_fail("listener out of memory");
+	else
+		while(atomic_load(&gsfs_soak_running))
+			gsfs_soak_listen(&state, buf, expected);
+
+	free(buf);
+	free(expected);
+	return NULL;
+}
+
+static void gsfs_soak_report(long elapsed_s, size_t rss)
+{
+	double ms[3];
+	long reads = gsfs_soak_percentiles(&gsfs_soak_interval_latency, 1, ms);
+	log_msg("    soak: %ld s, %ld songs, %ld reads this interval: p50 %.3f ms, p99 %.3f ms, p999 %.3f ms; %zu KiB resident\n",
+		elapsed_s, atomic_load(&gsfs_soak_songs), reads, ms[0], ms[1], ms[2], rss / 1024);
+	gsfs_audio_log_hits();
+}
+
+// Run the soak against the callbacks in oper, starting and stopping gsfs
+// around it as mounting would. Returns the exit status: 0 if nothing
+// failed.
+int gsfs_soak(char *rootdir, struct fuse_operations *oper)
+{
+	gsfs_soak_oper = oper;
+	gsfs_start(rootdir);
+	gsfs_soak_configure();
+	gsfs_soak_register();
+
+	pthread_t listeners[GSFS_SOAK_MAX_LISTENERS];
+	int started = 0;
+	atomic_store(&gsfs_soak_running, 1);
+	for(int i = 0; i < gsfs_soak_listeners; i++)
+		if(pthread_create(&listeners[started], NULL, gsfs_soak_listener, (void *) (intptr_t) (i + 1)) == 0)
+			started++;
+	if(started < gsfs_soak_listeners)
+		gsfs_soak_fail("started %d of %d listeners", started, gsfs_soak_listeners);
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	size_t baseline = 0, rss = 0;
+	long elapsed_s = 0;
+	while(elapsed_s < gsfs_soak_duration_s)
+	{
+		long wait_s = gsfs_soak_duration_s - elapsed_s;
+		sleep(wait_s < gsfs_soak_interval_s ? wait_s : gsfs_soak_interval_s);
+		elapsed_s = (long) (gsfs_soak_elapsed_ms(&start) / 1000);
+
+		rss = gsfs_soak_rss();
+		if(baseline == 0)
+			baseline = rss;
+		gsfs_soak_report(elapsed_s, rss);
+		// registrations keep failing cleanly however busy we are
+		gsfs_soak_register_unreachable();
+	}
+
+	atomic_store(&gsfs_soak_running, 0);
+	for(int i = 0; i < started; i++)
+		pthread_join(listeners[i], NULL);
+
+	double ms[3];
+	long reads = gsfs_soak_percentiles(&gsfs_soak_total_latency, 0, ms);
+	log_msg("    soak: %ld songs, %ld reads (%ld short): p50 %.3f ms, p99 %.3f ms, p999 %.3f ms; resident %zu KiB after the first interval, %zu KiB at the end\n",
+		atomic_load(&gsfs_soak_songs), reads, atomic_load(&gsfs_soak_short_reads),
+		ms[0], ms[1], ms[2], baseline / 1024, rss / 1024);
+	if(ms[2] > gsfs_soak_max_p999_ms)
+		gsfs_soak_fail("p999 read latency %.3f ms is over %ld ms", ms[2], gsfs_soak_max_p999_ms);
+	if(rss > baseline + (size_t) gsfs_soak_max_growth_mb * 1024 * 1024)
+		gsfs_soak_fail("resident set grew %zu KiB", (rss - baseline) / 1024);
+
+	gsfs_stop(rootdir);
+
+	long failures = atomic_load(&gsfs_soak_failures);
+	log_msg("    soak: %s, %ld failures\n", failures == 0 ? "passed" : "FAILED", failures);
+	fprintf(stderr, "soak %s: %ld failures, %ld reads, p999 %.3f ms\n",
+		failures == 0 ? "passed" : "FAILED", failures, reads, ms[2]);
+	return failures == 0 ? 0 : 1;
+}
+
+#endif
@@ -0,0 +1,283 @@
+/*
+  Front-coded name tables.
+
+  Album and song names aren't kept in the albums and songs themselves;
+  each directory (an artist's albums, an album's songs) gets one table
+  holding all of its names, sorted. Names are stored in buckets of
+  GSFS_STRTAB_BUCKET: the first name of a bucket is stored whole, and every
+  other name only as the length of the prefix it shares with the name
+  before it plus the rest of its bytes. Alongside each name is the index
+  of the album or song it names.
+
+  Lookups binary search the bucket heads and then decode at most one
+  bucket; listing a directory decodes the whole table front to back.
+
+  All lengths and indexes are stored as varints, and each table is a
+  single allocation.
+*/
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define GSFS_STRTAB_BUCKET 16
+
+typedef struct {
+	int    count;
+	int    num_restarts;
+	size_t size;               // bytes allocated for the whole table
+	unsigned int restarts[];   // where each bucket starts in the data,
+	                           // which follows straight after
+} GSFS_Strtab;
+
+typedef struct {
+	const char *name;
+	int index;
+} GSFS_Strtab_Entry;
+
+// Bytes held by every table, and what the same names would take as
+// MAX_PATH arrays, for the log
+atomic_size_t gsfs_strtab_bytes = 0;
+atomic_size_t gsfs_strtab_fixed_bytes = 0;
+
+static unsigned char *gsfs_strtab_data(GSFS_Strtab *table)
+{
+	return (unsigned char *) &(table->restarts[table->num_restarts]);
+}
+
+// Store value at out (unless out is NULL), returning how many bytes it takes
+static size_t gsfs_varint_put(unsigned char *out, unsigned int value)
+{
+	size_t n = 0;
+	while(value >= 0x80)
+	{
+		if(out != NULL)
+			out[n] = value | 0x80;
+		value >>= 7;
+		n++;
+	}
+	if(out != NULL)
+		out[n] = value;
+	return n + 1;
+}
+
+static unsigned int gsfs_varint_get(const unsigned char **in)
+{
+	unsigned int value = 0;
+	int shift = 0;
+	while(**in & 0x80)
+	{
+		value |= (unsigned int) (**in & 0x7f) << shift;
+		shift += 7;
+		(*in)++;
+	}
+	value |= (unsigned int) **in << shift;
+	(*in)++;
+	return value;
+}
+
+// Decode the entry at *in over the name before it, which is in name
+// already, and return the index stored with it
+static int gsfs_strtab_decode(const unsigned char **in, char name[MAX_PATH])
+{
+	unsigned int shared = gsfs_varint_get(in);
+	unsigned int len = gsfs_varint_get(in);
+	memcpy(name + shared, *in, len);
+	name[shared + len] = '\0';
+	*in += len;
+	return gsfs_varint_get(in);
+}
+
+// Encode the sorted entries into data and fill in restarts, or with both
+// NULL, just work out how many bytes of data they need
+static size_t gsfs_strtab_encode(
+	GSFS_Strtab_Entry *entries,
+	int count,
+	unsigned char *data,
+	unsigned int *restarts)
+{
+	size_t len = 0;
+
+	for(int i = 0; i < count; i++)
+	{
+		const char *name = entries[i].name;
+		size_t name_len = strnlen(name, MAX_PATH - 1);
+		size_t shared = 0;
+
+		if(i % GSFS_STRTAB_BUCKET == 0)
+		{
+			if(restarts != NULL)
+				restarts[i / GSFS_STRTAB_BUCKET] = len;
+		}
+		else
+		{
+			const char *previous = entries[i - 1].name;
+			while(shared < name_len && previous[shared] == name[shared])
+				shared++;
+		}
+
+		len += gsfs_varint_put(data != NULL ? data + len : NULL, shared);
+		len += gsfs_varint_put(data != NULL ? data + len : NULL, name_len - shared);
+		if(data != NULL)
+			memcpy(data + len, name + shared, name_len - shared);
+		len += name_len - shared;
+		len += gsfs_varint_put(data != NULL ? data + len : NULL, entries[i].index);
+	}
+
+	return len;
+}
+
+static int gsfs_strtab_entry_compare(const void *a, const void *b)
+{
+	return strcmp(((GSFS_Strtab_Entry *) a)->name, ((GSFS_Strtab_Entry *) b)->name);
+}
+
+// Build a table from count names, where names[i] names item i. The names
+// themselves aren't kept. Returns NULL if we're out of memory.
+GSFS_Strtab *gsfs_strtab_build(char **names, int count)
+{
+	GSFS_Strtab_Entry *entries = malloc((count > 0 ? count : 1) * sizeof(GSFS_Strtab_Entry));
+	if(entries == NULL)
+		return NULL;
+
+	for(int i = 0; i < count; i++)
+	{
+		entries[i].name = names[i];
+		entries[i].index = i;
+	}
+	qsort(entries, count, sizeof(GSFS_Strtab_Entry), gsfs_strtab_entry_compare);
+
+	int num_restarts = (count + GSFS_STRTAB_BUCKET - 1) / GSFS_STRTAB_BUCKET;
+	size_t size = sizeof(GSFS_Strtab)
+		+ num_restarts * sizeof(unsigned int)
+		+ gsfs_strtab_encode(entries, count, NULL, NULL);
+
+	GSFS_Strtab *table = malloc(size);
+	if(table != NULL)
+	{
+		table->count = count;
+		table->num_restarts = num_restarts;
+		table->size = size;
+		gsfs_strtab_encode(entries, count, gsfs_strtab_data(table), table->restarts);
+
+		atomic_fetch_add(&gsfs_strtab_bytes, size);
+		atomic_fetch_add(&gsfs_strtab_fixed_bytes, (size_t) count * MAX_PATH);
+	}
+
+	free(entries);
+	return table;
+}
+
+void gsfs_strtab_free(GSFS_Strtab *table)
+{
+	if(table == NULL)
+		return;
+	atomic_fetch_sub(&gsfs_strtab_bytes, table->size);
+	atomic_fetch_sub(&gsfs_strtab_fixed_bytes, (size_t) table->count * MAX_PATH);
+	free(table);
+}
+
+// Free names handed to us by the grooveshark client, once they're in a table
+void gsfs_free_names(char **names, int count)
+{
+	if(names == NULL)
+		return;
+	for(int i = 0; i < count; i++)
+		free(names[i]);
+	free(names);
+}
+
+// Find the index of the item with the given name, or -1
+int gsfs_strtab_find(GSFS_Strtab *table, const char *name)
+{
+	char current[MAX_PATH];
+
+	if(table == NULL || table->count == 0)
+		return -1;
+
+	unsigned char *data = gsfs_strtab_data(table);
+
+	// find the last bucket whose first name isn't past the one we want
+	int low = 0;
+	int high = table->num_restarts - 1;
+	while(low < high)
+	{
+		int middle = (low + high + 1) / 2;
+		const unsigned char *in = data + table->restarts[middle];
+		gsfs_strtab_decode(&in, current);
+		if(strcmp(current, name) <= 0)
+			low = middle;
+		else
+			high = middle - 1;
+	}
+
+	// then walk that bucket
+	const unsigned char *in = data + table->restarts[low];
+	int end = (low + 1) * GSFS_STRTAB_BUCKET;
+	if(end > table->count)
+		end = table->count;
+	for(int i = low * GSFS_STRTAB_BUCKET; i < end; i++)
+	{
+		int index = gsfs_strtab_decode(&in, current);
+		int compare = strcmp(current, name);
+		if(compare == 0)
+			return index;
+		if(compare > 0)
+			break;
+	}
+	return -1;
+}
+
+// Walks a table's names in sorted order
+typedef struct {
+	GSFS_Strtab *table;
+	int position;
+	const unsigned char *next;
+	char name[MAX_PATH];
+} GSFS_Strtab_Cursor;
+
+void gsfs_strtab_cursor_init(GSFS_Strtab_Cursor *cursor, GSFS_Strtab *table)
+{
+	cursor->table = table;
+	cursor->position = 0;
+	cursor->next = table != NULL ? gsfs_strtab_data(table) : NULL;
+	cursor->name[0] = '\0';
+}
+
+// Decode the next name into cursor->name, and its item's index into
+// index. Returns 0 once every name has been seen.
+int gsfs_strtab_cursor_next(GSFS_Strtab_Cursor *cursor, int *index)
+{
+	if(cursor->table == NULL || cursor->position >= cursor->table->count)
+		return 0;
+	*index = gsfs_strtab_decode(&cursor->next, cursor->name);
+	cursor->position++;
+	return 1;
+}
+
+// Copy out the name of item index; ENOENT if there's no such item.
+// Decodes the table up to the name, so this is for the odd lookup, not
+// for walking a directory.
+int gsfs_strtab_name(GSFS_Strtab *table, int index, char name[MAX_PATH])
+{
+	GSFS_Strtab_Cursor cursor;
+	int current;
+
+	gsfs_strtab_cursor_init(&cursor, table);
+	while(gsfs_strtab_cursor_next(&cursor, &current))
+	{
+		if(current == index)
+		{
+			strcpy(name, cursor.name);
+			return SUCCESS;
+		}
+	}
+	return ENOENT;
+}
+
+void gsfs_strtab_log_usage(void)
+{
+	log_msg("    names: %zu bytes front-coded, %zu as fixed MAX_PATH arrays\n",
+		atomic_load(&gsfs_strtab_bytes), atomic_load(&gsfs_strtab_fixed_bytes));
+}
@@ -0,0 +1,244 @@
+/*
+  Stub backend.
+
+  Built with GSFS_STUB_BACKEND, the three calls gsfs makes to the
+  grooveshark client -- gsfs_fetch_artist(), gsfs_fetch_albums() and
+  gsfs_fetch_audio() -- are answered here from a made up catalog instead,
+  so gsfs can run without grooveshark and what it serves can be checked
+  byte for byte (see gsfs_soak.c). Link it in place of the client.
+
+  Artists are called "Stub Artist N", for any N. Each has one to four
+  albums ("Album 1" on) of four to twelve songs ("Track 01" on). Every
+  seventh song shares its recording with songs on other albums, as songs
+  on compilations do, and every fifth recording starts with an ID3 tag
+  longer than a chunk, with no duration in the catalog, so what gsfs
+  knows about it has to come from its first frame. The audio is a run of
+  128 kbit/s MPEG 1 layer III frame headers, the rest of every frame
+  filled from a hash of the recording and the offset; see
+  gsfs_stub_audio().
+
+  "Unreachable N" artists are found, but fetching their albums fails as
+  if the connection dropped. Nobody else is found.
+
+  Every request waits GSFS_STUB_LATENCY_MS milliseconds (20 by default),
+  as a round trip to grooveshark would. Fault injection (gsfs_fault.c)
+  still applies on top.
+
+  gcc -DGSFS_STUB_BACKEND ... gsfs_stub.c
+*/
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#ifdef GSFS_STUB_BACKEND
+
+#define GSFS_STUB_FRAME 417           // a 128 kbit/s 44.1 kHz frame, unpadded
+#define GSFS_STUB_TAG 4096
+#define GSFS_STUB_LONG_TAG (300 * 1024)
+#define GSFS_STUB_UNREACHABLE 4096    // where unreachable artists are numbered from
+
+static long gsfs_stub_latency_ms = 20;
+static pthread_once_t gsfs_stub_once = PTHREAD_ONCE_INIT;
+
+static void gsfs_stub_init(void)
+{
+	const char *latency = getenv("GSFS_STUB_LATENCY_MS");
+	if(latency != NULL)
+		gsfs_stub_latency_ms = atol(latency);
+	log_msg("    stub backend: %ld ms a request\n", gsfs_stub_latency_ms);
+}
+
+static void gsfs_stub_request(void)
+{
+	pthread_once(&gsfs_stub_once, gsfs_stub_init);
+	if(gsfs_stub_latency_ms > 0)
+		usleep(gsfs_stub_latency_ms * 1000);
+}
+
+int gsfs_stub_num_albums(int artist)
+{
+	return 1 + artist % 4;
+}
+
+long gsfs_stub_album_id(int artist, int album)
+{
+	return (long) artist * 16 + album + 1;
+}
+
+int gsfs_stub_num_songs(long album_id)
+{
+	return 4 + album_id % 9;
+}
+
+long gsfs_stub_song_id(long album_id, int track)
+{
+	return album_id * 64 + track + 1;
+}
+
+// The recording a song is of
+long gsfs_stub_audio_id(long song_id)
+{
+	if(song_id % 7 == 0)
+		return 1 + (song_id / 7) % 8;
+	return 1000 + song_id;
+}
+
+// Where the recording's audio starts, past its ID3 tag
+size_t gsfs_stub_tag_length(long audio_id)
+{
+	return audio_id % 5 == 0 ? GSFS_STUB_LONG_TAG : GSFS_STUB_TAG;
+}
+
+size_t gsfs_stub_audio_size(long audio_id)
+{
+	return gsfs_stub_tag_length(audio_id)
+		+ (size_t) GSFS_STUB_FRAME * (2000 + audio_id * 7919 % 12000);
+}
+
+// Fill buf with len bytes of the recording, from offset. Whatever isn't a
+// tag or frame header has its top bit set and is never 0xff, so it can't
+// be mistaken for a frame or a Xing header.
+void gsfs_stub_audio(long audio_id, off_t offset, unsigned char *buf, size_t len)
+{
+	size_t tag = gsfs_stub_tag_length(audio_id);
+	size_t size = tag - 10;
+	const unsigned char header[10] = {
+		'I', 'D', '3', 4, 0, 0,
+		(size >> 21) & 0x7f, (size >> 14) & 0x7f, (size >> 7) & 0x7f, size & 0x7f
+	};
+	const unsigned char frame[4] = { 0xff, 0xfb, 0x90, 0x00 };
+
+	for(size_t i = 0; i < len; i++)
+	{
+		unsigned long at = offset + i;
+		if(at < sizeof(header))
+			buf[i] = header[at];
+		else if(at >= tag && (at - tag) % GSFS_STUB_FRAME < sizeof(frame))
+			buf[i] = frame[(at - tag) % GSFS_STUB_FRAME];
+		else
+		{
+			unsigned long h = (audio_id * 0x9e3779b97f4a7c15UL) ^ (at * 0xc2b2ae3d27d4eb4fUL);
+			h ^= h >> 29;
+			h *= 0xbf58476d1ce4e5b9UL;
+			h ^= h >> 32;
+			buf[i] = 0x80 | (h & 0x7e);
+		}
+	}
+}
+
+// Which artist a name is, or -1 if nobody by that name
+static int gsfs_stub_artist(const char *name, char canonical[MAX_PATH])
+{
+	int index;
+	if(sscanf(name, "Stub Artist %d", &index) == 1 && index >= 0
+		&& index < GSFS_STUB_UNREACHABLE)
+		snprintf(canonical, MAX_PATH, "Stub Artist %d", index);
+	else if(sscanf(name, "Unreachable %d", &index) == 1 && index >= 0)
+	{
+		snprintf(canonical, MAX_PATH, "Unreachable %d", index);
+		index += GSFS_STUB_UNREACHABLE;
+	}
+	else
+		return -1;
+	return strcasecmp(name, canonical) == 0 ? index : -1;
+}
+
+int gsfs_fetch_artist(
+	const char *name,
+	Artist *artist,
+	char ***album_names)
+{
+	char canonical[MAX_PATH];
+	gsfs_stub_request();
+
+	int index = gsfs_stub_artist(name, canonical);
+	if(index < 0)
+		return ERROR_ARTIST_NOT_FOUND;
+
+	// whatever was allocated before running out is the caller's to free
+	artist->name = strdup(canonical);
+	artist->num_albums = gsfs_stub_num_albums(index);
+	artist->albums = calloc(artist->num_albums, sizeof(Album));
+	*album_names = calloc(artist->num_albums, sizeof(char *));
+	if(artist->name == NULL || artist->albums == NULL || *album_names == NULL)
+		return ERROR_CONNECTION_LOST;
+
+	for(int i = 0; i < artist->num_albums; i++)
+	{
+		char album_name[MAX_PATH];
+		snprintf(album_name, MAX_PATH, "Album %d", i + 1);
+		artist->albums[i].album_id = gsfs_stub_album_id(index, i);
+		(*album_names)[i] = strdup(album_name);
+		if((*album_names)[i] == NULL)
+			return ERROR_CONNECTION_LOST;
+	}
+	return SUCCESS;
+}
+
+int gsfs_fetch_albums(
+	Album **albums,
+	int num_albums,
+	char ***song_names)
+{
+	gsfs_stub_request();
+
+	for(int i = 0; i < num_albums; i++)
+	{
+		Album *album = albums[i];
+		if((album->album_id - 1) / 16 >= GSFS_STUB_UNREACHABLE)
+			return ERROR_CONNECTION_LOST;
+
+		album->num_songs = gsfs_stub_num_songs(album->album_id);
+		album->songs = calloc(album->num_songs, sizeof(Song));
+		song_names[i] = calloc(album->num_songs, sizeof(char *));
+		if(album->songs == NULL || song_names[i] == NULL)
+			return ERROR_CONNECTION_LOST;
+
+		for(int j = 0; j < album->num_songs; j++)
+		{
+			Song *song = &(album->songs[j]);
+			song->song_id = gsfs_stub_song_id(album->album_id, j);
+			song->audio_id = gsfs_stub_audio_id(song->song_id);
+			song->size = gsfs_stub_audio_size(song->audio_id);
+			// long tags come without a duration, so it has to be read
+			// off the first frame
+			size_t tag = gsfs_stub_tag_length(song->audio_id);
+			song->duration_ms = tag == GSFS_STUB_LONG_TAG ? 0
+				: (long) ((song->size - tag) * 8 / 128);
+
+			char song_name[MAX_PATH];
+			snprintf(song_name, MAX_PATH, "Track %02d", j + 1);
+			song_names[i][j] = strdup(song_name);
+			if(song_names[i][j] == NULL)
+				return ERROR_CONNECTION_LOST;
+		}
+	}
+	return SUCCESS;
+}
+
+int gsfs_fetch_audio(
+	long song_id,
+	off_t offset,
+	size_t size,
+	char *buf,
+	size_t *len)
+{
+	gsfs_stub_request();
+
+	long audio_id = gsfs_stub_audio_id(song_id);
+	size_t audio_size = gsfs_stub_audio_size(audio_id);
+	*len = 0;
+	if((size_t) offset >= audio_size)
+		return SUCCESS;
+	if(offset + size > audio_size)
+		size = audio_size - offset;
+	gsfs_stub_audio(audio_id, offset, (unsigned char *) buf, size);
+	*len = size;
+	return SUCCESS;
+}
+
+#endif
@@ -0,0 +1,484 @@
+/*
+  Transcoded variants of songs.
+
+  A song "foo.mp3" may also be opened as "foo.128k.mp3", in which case
+  its audio is decoded with libmpg123 and re-encoded with LAME at the
+  requested bitrate. Encoding is streamed: the encoder appends its output
+  to the variant's chunks as it goes, so a read at offset N only waits
+  until N bytes have been produced, not for the whole song.
+
+  Variants are encoded as GSFS_PRIO_TRANSCODE jobs on the scheduler's
+  workers (see gsfs_sched.c), and once encoded they stay cached alongside the song's
+  original audio, counted against the same budget. A variant nobody has
+  open can be evicted whole when the cache runs over; it's encoded again
+  the next time it's opened. Its chunks are charged whole, as allocated,
+  however much of the last one the encoder has filled.
+
+  Readers copy out of a variant without holding gsfs_transcode_lock:
+  bytes the encoder has produced never change, and an open file's
+  reference keeps the chunks they're in from being freed.
+
+  gcc ... gsfs_transcode.c -lmpg123 -lmp3lame
+*/
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <lame/lame.h>
+#include <mpg123.h>
+
+// Bitrates (in kbit/s) we are willing to produce variants at
+static const int gsfs_variant_bitrates[] = { 64, 96, 128, 192 };
+
+typedef struct GSFS_Variant {
+	Song *song;
+	int   bitrate;
+
+	// encoded audio, appended to as the encoder produces it
+	GSFS_Audio_Chunk *chunks;
+	int    num_chunks;
+	size_t produced;
+	size_t allocated;  // bytes of chunks, as charged to the audio budget
+	int    done;
+	int    error;
+	int    refs;   // one per open file, and one until it's encoded
+	int    linked; // still on the song's list of variants
+
+	struct GSFS_Variant *next;       // next variant of the same song
+
+	// variants nobody has open, most recently closed first
+	struct GSFS_Variant *idle_prev;
+	struct GSFS_Variant *idle_next;
+} GSFS_Variant;
+
+// Guards every variant and the idle list; gsfs_transcode_cond is
+// broadcast whenever a variant grows. Never held while taking
+// gsfs_audio_lock, as eviction takes them the other way round.
+static pthread_mutex_t gsfs_transcode_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  gsfs_transcode_cond = PTHREAD_COND_INITIALIZER;
+static GSFS_Variant *gsfs_idle_head = NULL;
+static GSFS_Variant *gsfs_idle_tail = NULL;
+static pthread_once_t gsfs_transcode_once = PTHREAD_ONCE_INIT;
+
+int gsfs_variant_bitrate_supported(long bitrate)
+{
+	for(int i = 0; i < sizeof(gsfs_variant_bitrates) / sizeof(int); i++)
+		if(gsfs_variant_bitrates[i] == bitrate)
+			return 1;
+	return 0;
+}
+
+// Append encoder output to a variant, filling its chunks in order.
+// Called with gsfs_transcode_lock held.
+static int gsfs_variant_append(
+	GSFS_Variant *variant,
+	unsigned char *data,
+	size_t len)
+{
+	while(len > 0)
+	{
+		size_t used = variant->produced % GSFS_CHUNK_SIZE;
+
+		// the last chunk is full (or there isn't one); start a new one
+		if(used == 0)
+		{
+			GSFS_Audio_Chunk *chunks = realloc(variant->chunks,
+				(variant->num_chunks + 1) * sizeof(GSFS_Audio_Chunk));
+			if(chunks == NULL)
+				return ENOMEM;
+			variant->chunks = chunks;
+
+			GSFS_Audio_Chunk *chunk = &(chunks[variant->num_chunks]);
+			chunk->data = malloc(GSFS_CHUNK_SIZE);
+			if(chunk->data == NULL)
+				return ENOMEM;
+			chunk->len = 0;
+			chunk->state = CHUNK_READY;
+			variant->num_chunks++;
+			variant->allocated += GSFS_CHUNK_SIZE;
+		}
+
+		GSFS_Audio_Chunk *chunk = &(variant->chunks[variant->num_chunks - 1]);
+		size_t n = GSFS_CHUNK_SIZE - used;
+		if(n > len)
+			n = len;
+		memcpy(chunk->data + used, data, n);
+		chunk->len += n;
+		variant->produced += n;
+		data += n;
+		len -= n;
+	}
+
+	return SUCCESS;
+}
+
+static int gsfs_variant_publish(
+	GSFS_Variant *variant,
+	unsigned char *data,
+	int len)
+{
+	int error;
+
+	if(len <= 0)
+		return len < 0 ? ENOMEM : SUCCESS;
+
+	pthread_mutex_lock(&gsfs_transcode_lock);
+	size_t before = variant->allocated;
+	error = gsfs_variant_append(variant, data, len);
+	size_t allocated = variant->allocated - before;
+	pthread_cond_broadcast(&gsfs_transcode_cond);
+	pthread_mutex_unlock(&gsfs_transcode_lock);
+
+	gsfs_audio_charge(allocated);
+	return error;
+}
+
+// Decode the song's original audio and re-encode it at the variant's
+// bitrate, publishing the output as we go
+static int gsfs_transcode(GSFS_Variant *variant)
+{
+	Song *song = variant->song;
+	int error = SUCCESS;
+	int err;
+
+	mpg123_handle *decoder = mpg123_new(NULL, &err);
+	if(decoder == NULL)
+		return ENOMEM;
+
+	// ask the decoder for 16-bit samples, whatever the input rate
+	const long *rates;
+	size_t num_rates;
+	mpg123_rates(&rates, &num_rates);
+	mpg123_format_none(decoder);
+	for(size_t i = 0; i < num_rates; i++)
+		mpg123_format(decoder, rates[i], MPG123_MONO | MPG123_STEREO, MPG123_ENC_SIGNED_16);
+	mpg123_open_feed(decoder);
+
+	lame_global_flags *encoder = NULL;
+	int channels = 2;
+
+	short pcm[8192];
+	int   mp3_size = 5 * sizeof(pcm) / 4 + 7200;
+	unsigned char *mp3 = malloc(mp3_size);
+	if(mp3 == NULL)
+		error = ENOMEM;
+
+	int num_chunks = gsfs_song_num_chunks(song);
+	for(int i = 0; error == SUCCESS && i < num_chunks; i++)
+	{
+		GSFS_Audio_Chunk *chunk;
+		// somebody is waiting to read the variant
+		error = gsfs_get_song_audio(song, i, GSFS_PRIO_READ, &chunk);
+		if(error != SUCCESS)
+			break;
+
+		mpg123_feed(decoder, (unsigned char *) chunk->data, chunk->len);
+		gsfs_put_song_audio(chunk);
+
+		// drain every sample the decoder can give us from what we fed it
+		for(;;)
+		{
+			size_t bytes;
+			int status = mpg123_read(decoder, (unsigned char *) pcm, sizeof(pcm), &bytes);
+
+			if(status == MPG123_NEW_FORMAT)
+			{
+				long rate;
+				int encoding;
+				mpg123_getformat(decoder, &rate, &channels, &encoding);
+
+				if(encoder == NULL)
+				{
+					encoder = lame_init();
+					lame_set_in_samplerate(encoder, rate);
+					lame_set_num_channels(encoder, channels);
+					lame_set_brate(encoder, variant->bitrate);
+					// no Xing header: it would have to be rewritten once
+					// we know the length, after it has been read
+					lame_set_bWriteVbrTag(encoder, 0);
+					if(lame_init_params(encoder) < 0)
+					{
+						error = ENOMEM;
+						break;
+					}
+				}
+				continue;
+			}
+
+			if(bytes > 0 && encoder != NULL)
+			{
+				int samples = bytes / sizeof(short) / channels;
+				int len = channels == 2
+					? lame_encode_buffer_interleaved(encoder, pcm, samples, mp3, mp3_size)
+					: lame_encode_buffer(encoder, pcm, pcm, samples, mp3, mp3_size);
+				error = gsfs_variant_publish(variant, mp3, len);
+				if(error != SUCCESS)
+					break;
+			}
+
+			if(status != MPG123_OK)
+				break;
+		}
+	}
+
+	if(error == SUCCESS && encoder != NULL)
+		error = gsfs_variant_publish(variant, mp3,
+			lame_encode_flush(encoder, mp3, mp3_size));
+
+	if(encoder != NULL)
+		lame_close(encoder);
+	mpg123_delete(decoder);
+	free(mp3);
+
+	return error;
+}
+
+// Free a variant's encoded audio, returning how many bytes of chunks
+// that was. Called with gsfs_transcode_lock held.
+static size_t gsfs_variant_discard(GSFS_Variant *variant)
+{
+	size_t bytes = variant->allocated;
+	for(int i = 0; i < variant->num_chunks; i++)
+		free(variant->chunks[i].data);
+	free(variant->chunks);
+	variant->chunks = NULL;
+	variant->num_chunks = 0;
+	variant->produced = 0;
+	variant->allocated = 0;
+	return bytes;
+}
+
+// Take a variant off its song's list, so the next open encodes it anew.
+// Called with gsfs_transcode_lock held.
+static void gsfs_variant_unlink(GSFS_Variant *variant)
+{
+	GSFS_Variant **slot = &(variant->song->variants);
+	while(*slot != variant)
+		slot = &((*slot)->next);
+	*slot = variant->next;
+	variant->linked = 0;
+}
+
+static void gsfs_idle_unlink(GSFS_Variant *variant)
+{
+	if(variant->idle_prev != NULL)
+		variant->idle_prev->idle_next = variant->idle_next;
+	else
+		gsfs_idle_head = variant->idle_next;
+	if(variant->idle_next != NULL)
+		variant->idle_next->idle_prev = variant->idle_prev;
+	else
+		gsfs_idle_tail = variant->idle_prev;
+	variant->idle_prev = variant->idle_next = NULL;
+}
+
+// Drop a reference to a variant. An encoded variant nobody has open goes
+// on the idle list to be evicted, one that failed or was evicted is
+// freed. Returns how many bytes of chunks that freed, for the caller to
+// take off the budget once it has let go of gsfs_transcode_lock. Called
+// with gsfs_transcode_lock held.
+static size_t gsfs_variant_unref(GSFS_Variant *variant)
+{
+	size_t discarded = 0;
+
+	if(--variant->refs > 0)
+		return 0;
+
+	if(variant->linked)
+	{
+		variant->idle_prev = NULL;
+		variant->idle_next = gsfs_idle_head;
+		if(gsfs_idle_head != NULL)
+			gsfs_idle_head->idle_prev = variant;
+		else
+			gsfs_idle_tail = variant;
+		gsfs_idle_head = variant;
+	}
+	else
+	{
+		discarded = gsfs_variant_discard(variant);
+		free(variant);
+	}
+	return discarded;
+}
+
+// Evict idle variants, longest closed first, until at least bytes have
+// been freed or none are left. Returns how much was freed; the caller
+// holds gsfs_audio_lock and takes it off gsfs_audio_bytes.
+size_t gsfs_variants_evict(size_t bytes)
+{
+	size_t freed = 0;
+
+	pthread_mutex_lock(&gsfs_transcode_lock);
+	while(freed < bytes && gsfs_idle_tail != NULL)
+	{
+		GSFS_Variant *variant = gsfs_idle_tail;
+		gsfs_idle_unlink(variant);
+		gsfs_variant_unlink(variant);
+		freed += gsfs_variant_discard(variant);
+		free(variant);
+	}
+	pthread_mutex_unlock(&gsfs_transcode_lock);
+
+	return freed;
+}
+
+// Encode a variant. Only cancelled if the job couldn't be queued, in
+// which case the variant fails and the next open tries again.
+static void gsfs_transcode_job(void *arg, int cancelled)
+{
+	GSFS_Variant *variant = arg;
+	Song *song = variant->song;
+	int error = cancelled ? ENOMEM : gsfs_transcode(variant);
+	size_t discarded = 0;
+
+	pthread_mutex_lock(&gsfs_transcode_lock);
+	variant->error = error;
+	variant->done = 1;
+	// a half encoded variant is no use to anybody; whoever has it open
+	// gets the error, and the next open starts over. Its chunks go with
+	// the last reference, as readers may still be copying out of them.
+	if(error != SUCCESS)
+		gsfs_variant_unlink(variant);
+	pthread_cond_broadcast(&gsfs_transcode_cond);
+	discarded = gsfs_variant_unref(variant);
+	pthread_mutex_unlock(&gsfs_transcode_lock);
+
+	gsfs_audio_charge(-(long) discarded);
+
+	// taken when the variant was queued
+	gsfs_artist_unref(song->album->artist);
+}
+
+static void gsfs_transcode_start(void)
+{
+	mpg123_init();
+}
+
+// Find the song's variant at the given bitrate, queueing it to be encoded
+// if nobody has asked for it before (or it has been evicted since). Hand
+// it back with gsfs_put_variant().
+GSFS_Variant *gsfs_get_variant(Song *song, int bitrate)
+{
+	pthread_once(&gsfs_transcode_once, gsfs_transcode_start);
+
+	pthread_mutex_lock(&gsfs_transcode_lock);
+
+	GSFS_Variant *variant = song->variants;
+	while(variant != NULL && variant->bitrate != bitrate)
+		variant = variant->next;
+
+	int queue = 0;
+	if(variant != NULL)
+	{
+		if(variant->refs++ == 0)
+			gsfs_idle_unlink(variant);
+	}
+	else
+	{
+		variant = calloc(1, sizeof(GSFS_Variant));
+		if(variant != NULL)
+		{
+			variant->song = song;
+			variant->bitrate = bitrate;
+			variant->refs = 2;
+			variant->linked = 1;
+			variant->next = song->variants;
+			song->variants = variant;
+
+			// keep the song around until it's encoded
+			gsfs_artist_ref(song->album->artist);
+			queue = 1;
+		}
+	}
+
+	pthread_mutex_unlock(&gsfs_transcode_lock);
+
+	// not under the lock: a job that can't be queued runs right here
+	if(queue)
+		gsfs_sched_submit(GSFS_PRIO_TRANSCODE, NULL, gsfs_transcode_job, variant);
+	return variant;
+}
+
+void gsfs_put_variant(GSFS_Variant *variant)
+{
+	pthread_mutex_lock(&gsfs_transcode_lock);
+	size_t discarded = gsfs_variant_unref(variant);
+	pthread_mutex_unlock(&gsfs_transcode_lock);
+
+	gsfs_audio_charge(-(long) discarded);
+}
+
+// Read encoded audio from a variant, waiting only until the encoder has
+// produced the bytes asked for (or finished). Returns the number of bytes
+// copied, or a negative error if encoding failed before reaching offset.
+// The copying is done unlocked (see above), so as not to hold up every
+// encoder.
+int gsfs_read_variant(
+	GSFS_Variant *variant,
+	char *buf,
+	size_t size,
+	off_t offset)
+{
+	pthread_mutex_lock(&gsfs_transcode_lock);
+
+	while(!variant->done && variant->produced < offset + size)
+		pthread_cond_wait(&gsfs_transcode_cond, &gsfs_transcode_lock);
+
+	size_t produced = variant->produced;
+	if(produced < offset + size && variant->error != SUCCESS)
+	{
+		int error = variant->error;
+		pthread_mutex_unlock(&gsfs_transcode_lock);
+		return -error;
+	}
+
+	pthread_mutex_unlock(&gsfs_transcode_lock);
+
+	size_t copied = 0;
+	while(offset + copied < produced && copied < size)
+	{
+		size_t index = (offset + copied) / GSFS_CHUNK_SIZE;
+		size_t chunk_offset = (offset + copied) % GSFS_CHUNK_SIZE;
+
+		// the array of chunks moves as the encoder adds to it; what
+		// they point to doesn't
+		pthread_mutex_lock(&gsfs_transcode_lock);
+		char *data = variant->chunks[index].data;
+		pthread_mutex_unlock(&gsfs_transcode_lock);
+
+		size_t len = GSFS_CHUNK_SIZE - chunk_offset;
+		if(len > produced - (offset + copied))
+			len = produced - (offset + copied);
+		if(len > size - copied)
+			len = size - copied;
+		memcpy(buf + copied, data + chunk_offset, len);
+		copied += len;
+	}
+
+	return copied;
+}
+
+// Free every variant of a song, once nothing can be reading or encoding
+// them any more (so they're all idle)
+void gsfs_free_variants(Song *song)
+{
+	size_t discarded = 0;
+
+	pthread_mutex_lock(&gsfs_transcode_lock);
+	GSFS_Variant *variant = song->variants;
+	while(variant != NULL)
+	{
+		GSFS_Variant *next = variant->next;
+		gsfs_idle_unlink(variant);
+		discarded += gsfs_variant_discard(variant);
+		free(variant);
+		variant = next;
+	}
+	song->variants = NULL;
+	pthread_mutex_unlock(&gsfs_transcode_lock);
+
+	gsfs_audio_charge(-(long) discarded);
+}